@@ -0,0 +1,594 @@
+/* -----------------------------------------------------------------------
+ *  <copyright file="BatchConverter.cpp" company="Global Graphics Software Ltd">
+ *      Copyright (c) 2023 Global Graphics Software Ltd. All rights reserved.
+ *  </copyright>
+ *  <summary>
+ *  This example is provided on an "as is" basis and without warranty of any kind.
+ *  Global Graphics Software Ltd. does not warrant or make any representations regarding the use or
+ *  results of use of this example.
+ *  </summary>
+ * -----------------------------------------------------------------------
+ */
+
+#include "BatchConverter.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include <jawsmako/customtransform.h>
+
+#include "MemoryStreams.h"
+#include "PageCost.h"
+
+namespace fs = std::filesystem;
+
+using namespace EDL;
+
+static const char* objectTypeName(CRichBlackObject::eObjectType type)
+{
+    switch (type)
+    {
+    case CRichBlackObject::eFill:           return "fill";
+    case CRichBlackObject::eStroke:         return "stroke";
+    case CRichBlackObject::eGlyphs:         return "glyphs";
+    case CRichBlackObject::ePatternColor:   return "patternColor";
+    case CRichBlackObject::eImage:          return "image";
+    }
+    return "unknown";
+}
+
+static std::string jsonEscape(const std::string& text)
+{
+    std::string escaped;
+    for (const char c : text)
+    {
+        switch (c)
+        {
+        case '"':  escaped += "\\\""; break;
+        case '\\': escaped += "\\\\"; break;
+        case '\n': escaped += "\\n"; break;
+        case '\r': escaped += "\\r"; break;
+        case '\t': escaped += "\\t"; break;
+        default:
+            if (static_cast<unsigned char>(c) < 0x20)
+            {
+                char buf[8];
+                snprintf(buf, sizeof(buf), "\\u%04x", c);
+                escaped += buf;
+            }
+            else
+            {
+                escaped += c;
+            }
+        }
+    }
+    return escaped;
+}
+
+// Write the analysis as a JSON report. Bounds are given as [x, y, width, height].
+void writeAnalysisReport(std::ostream& out, const std::string& inputFile, const std::vector<CPageAnalysis>& pages)
+{
+    bool documentHasRichBlack = false;
+    for (const auto& page : pages)
+    {
+        documentHasRichBlack |= !page.objects.empty();
+    }
+
+    out << "{\n";
+    out << "  \"file\": \"" << jsonEscape(inputFile) << "\",\n";
+    out << "  \"richBlack\": " << (documentHasRichBlack ? "true" : "false") << ",\n";
+    out << "  \"pages\": [";
+    for (size_t pageIndex = 0; pageIndex < pages.size(); pageIndex++)
+    {
+        const CPageAnalysis& page = pages[pageIndex];
+
+        uint32 counts[CRichBlackObject::eImage + 1] = {};
+        for (const auto& object : page.objects)
+        {
+            counts[object.type]++;
+        }
+
+        out << (pageIndex ? "," : "") << "\n    {\n";
+        out << "      \"page\": " << page.pageNumber << ",\n";
+        out << "      \"richBlack\": " << (page.objects.empty() ? "false" : "true") << ",\n";
+        out << "      \"fills\": " << counts[CRichBlackObject::eFill] << ",\n";
+        out << "      \"strokes\": " << counts[CRichBlackObject::eStroke] << ",\n";
+        out << "      \"glyphs\": " << counts[CRichBlackObject::eGlyphs] << ",\n";
+        out << "      \"patternColors\": " << counts[CRichBlackObject::ePatternColor] << ",\n";
+        out << "      \"images\": " << counts[CRichBlackObject::eImage] << ",\n";
+        out << "      \"objects\": [";
+        for (size_t objectIndex = 0; objectIndex < page.objects.size(); objectIndex++)
+        {
+            const CRichBlackObject& object = page.objects[objectIndex];
+            out << (objectIndex ? "," : "") << "\n        { \"type\": \"" << objectTypeName(object.type) << "\", \"bounds\": ["
+                << object.bounds.x << ", " << object.bounds.y << ", " << object.bounds.dX << ", " << object.bounds.dY << "] }";
+        }
+        out << (page.objects.empty() ? "" : "\n      ") << "]\n";
+        out << "    }";
+    }
+    out << (pages.empty() ? "" : "\n  ") << "]\n";
+    out << "}\n";
+}
+
+// A page to transform, with its estimated and measured cost
+struct CBatchConverter::CPageJob
+{
+    uint32 pageIndex;
+    IPagePtr page;
+    uint64 estimate;
+    double seconds;
+    size_t position;        // In the order the pages are transformed
+};
+
+// A document in flight. Each stage counts down its tasks, and the task that finishes last starts the next stage.
+struct CBatchConverter::CDocumentJob
+{
+    std::string inputFile;
+    std::string outputFile;
+    IRAInputStreamPtr inputStream;  // Used instead of the files when set
+    IOutputStreamPtr outputStream;
+    uint64 budgetBytes;
+    std::string cacheKey;
+
+    std::unique_ptr<CCmykBlackConverterImplementation> converter;
+    IDocumentAssemblyPtr assembly;
+    std::vector<CPageJob> pages;
+    std::vector<CPageAnalysis> analysis;
+    CLookAheadDetector::CDocumentPtr detectAhead;
+    std::atomic<size_t> remaining;
+
+    std::mutex errorMutex;
+    std::exception_ptr error;       // The first error; later stages are skipped
+    std::atomic<bool> failed;
+};
+
+CBatchConverter::CBatchConverter(const IJawsMakoPtr& jawsMako, const CCmykBlackConverterOptions& options, uint32 numThreads,
+                                 uint64 maxInFlightBytes) :
+    m_jawsMako(jawsMako), m_options(options), m_cache(nullptr), m_mapInput(false), m_reportErrors(true), m_budget(maxInFlightBytes),
+    m_cacheHits(0), m_exitCode(0), m_pool(numThreads)
+{
+    m_options.taskPool = &m_pool;
+}
+
+CBatchConverter::~CBatchConverter()
+{
+    try
+    {
+        m_pool.wait();
+    }
+    catch (...)
+    {
+    }
+}
+
+void CBatchConverter::setDetectAheadDepth(uint32 depth)
+{
+    m_detector.reset(depth ? new CLookAheadDetector(m_jawsMako, m_pool, depth) : nullptr);
+}
+
+void CBatchConverter::setResultCache(CResultCache* cache, const std::string& settings)
+{
+    m_cache = cache;
+    m_cacheSettings = settings;
+}
+
+void CBatchConverter::add(const std::string& inputFile, const std::string& outputFile)
+{
+    add(inputFile, outputFile, IRAInputStreamPtr(), IOutputStreamPtr());
+}
+
+void CBatchConverter::add(const std::string& inputFile, const std::string& outputFile, const IRAInputStreamPtr& input, const IOutputStreamPtr& output)
+{
+    CDocumentJobPtr job = std::make_shared<CDocumentJob>();
+    job->inputFile = inputFile;
+    job->outputFile = outputFile;
+    job->inputStream = input;
+    job->outputStream = output;
+    job->failed = false;
+
+    // The size of the input is a fair guide to the memory a document needs while it is open
+    if (input)
+    {
+        const int64 inputBytes = input->length();
+        job->budgetBytes = inputBytes > 0 ? static_cast<uint64>(inputBytes) : 0;
+    }
+    else
+    {
+        std::error_code error;
+        const uintmax_t inputBytes = fs::file_size(inputFile, error);
+        job->budgetBytes = error ? 0 : static_cast<uint64>(inputBytes);
+    }
+
+    m_budget.acquire(job->budgetBytes);
+    m_pool.submit([this, job] { openDocument(job); });
+}
+
+int CBatchConverter::finish()
+{
+    m_pool.wait();
+    return m_exitCode;
+}
+
+void CBatchConverter::reset()
+{
+    std::lock_guard<std::mutex> lock(m_resultMutex);
+    m_stats = CTransformStats();
+    m_pageCosts.clear();
+    m_cacheHits = 0;
+    m_exitCode = 0;
+    m_firstError.clear();
+}
+
+std::wstring CBatchConverter::getFirstError() const
+{
+    std::lock_guard<std::mutex> lock(m_resultMutex);
+    return m_firstError;
+}
+
+CTransformStats CBatchConverter::getStats() const
+{
+    std::lock_guard<std::mutex> lock(m_resultMutex);
+    return m_stats;
+}
+
+double CBatchConverter::getTransformSeconds() const
+{
+    std::lock_guard<std::mutex> lock(m_resultMutex);
+
+    double totalSeconds = 0.0;
+    for (const auto& cost : m_pageCosts)
+    {
+        totalSeconds += cost.second;
+    }
+    return totalSeconds;
+}
+
+double CBatchConverter::getEstimateError() const
+{
+    std::lock_guard<std::mutex> lock(m_resultMutex);
+
+    // The estimates are in arbitrary units, so scale them to the total time taken
+    double totalEstimate = 0.0;
+    double totalSeconds = 0.0;
+    for (const auto& cost : m_pageCosts)
+    {
+        totalEstimate += static_cast<double>(cost.first);
+        totalSeconds += cost.second;
+    }
+    if (totalEstimate <= 0.0 || totalSeconds <= 0.0)
+    {
+        return 0.0;
+    }
+
+    double totalError = 0.0;
+    for (const auto& cost : m_pageCosts)
+    {
+        totalError += std::fabs(static_cast<double>(cost.first) / totalEstimate * totalSeconds - cost.second);
+    }
+    return totalError / totalSeconds;
+}
+
+// Check the cache, open the document and start estimating its pages
+void CBatchConverter::openDocument(const CDocumentJobPtr& job)
+{
+    try
+    {
+        if (m_cache && !m_options.analyzeOnly && !job->inputStream && !job->outputStream)
+        {
+            // A resubmitted document can be satisfied from the cache without converting it again
+            job->cacheKey = CResultCache::makeKey(job->inputFile, m_cacheSettings);
+            if (!job->cacheKey.empty() && m_cache->fetch(job->cacheKey, job->outputFile))
+            {
+                m_cacheHits++;
+                finishDocument(job);
+                return;
+            }
+        }
+
+        const IInputPtr input = IInput::create(m_jawsMako, eFFPDF);
+        if (job->inputStream)
+        {
+            job->assembly = input->open(job->inputStream);
+        }
+        else if (m_mapInput)
+        {
+            // The cross reference table is read through in order when the document is opened, and the objects
+            // are read as they are needed after that
+            const CFileMappingPtr mapping = std::make_shared<CFileMapping>(job->inputFile);
+            mapping->adviseSequential();
+            job->assembly = input->open(createMappedInputStream(mapping));
+            mapping->adviseRandom();
+        }
+        else
+        {
+            job->assembly = input->open(job->inputFile.c_str());
+        }
+        const IDocumentPtr document = job->assembly->getDocument();
+
+        // One converter per document, so that its caches go with the document
+        job->converter.reset(new CCmykBlackConverterImplementation(m_jawsMako, m_options));
+
+        const uint32 numPages = document->getNumPages();
+        job->pages.resize(numPages);
+        for (uint32 pageIndex = 0; pageIndex < numPages; pageIndex++)
+        {
+            job->pages[pageIndex] = { pageIndex, document->getPage(pageIndex), 0, 0.0, 0 };
+        }
+        job->analysis.resize(m_options.analyzeOnly ? numPages : 0);
+    }
+    catch (...)
+    {
+        fail(*job);
+        finishDocument(job);
+        return;
+    }
+
+    if (job->pages.empty())
+    {
+        writeDocument(job);
+        return;
+    }
+
+    job->remaining = job->pages.size();
+    for (CPageJob& page : job->pages)
+    {
+        m_pool.submit([this, job, &page] { estimatePage(job, page); });
+    }
+}
+
+void CBatchConverter::estimatePage(const CDocumentJobPtr& job, CPageJob& page)
+{
+    if (!job->failed)
+    {
+        try
+        {
+            CPageCostEstimator estimator(m_jawsMako);
+            page.estimate = estimator.estimate(page.page);
+        }
+        catch (...)
+        {
+            fail(*job);
+        }
+    }
+
+    if (--job->remaining == 0)
+    {
+        transformPages(job);
+    }
+}
+
+// Start the most expensive pages first so that a page with large images does not leave the other threads idle
+// at the end. Later documents' pages queue behind these, so this orders pages within a document only.
+void CBatchConverter::transformPages(const CDocumentJobPtr& job)
+{
+    if (job->failed)
+    {
+        finishDocument(job);
+        return;
+    }
+
+    std::vector<CPageJob*> schedule;
+    for (CPageJob& page : job->pages)
+    {
+        schedule.push_back(&page);
+    }
+    std::stable_sort(schedule.begin(), schedule.end(), [](const CPageJob* a, const CPageJob* b) { return a->estimate > b->estimate; });
+
+    // The look-ahead detector works through the pages in the same order
+    if (m_detector)
+    {
+        std::vector<IPagePtr> pages;
+        for (size_t position = 0; position < schedule.size(); position++)
+        {
+            schedule[position]->position = position;
+            pages.push_back(schedule[position]->page);
+        }
+        job->detectAhead = m_detector->addDocument(pages, job->converter.get());
+    }
+
+    job->remaining = schedule.size();
+    for (CPageJob* page : schedule)
+    {
+        m_pool.submit([this, job, page] { transformPage(job, *page); });
+    }
+}
+
+void CBatchConverter::transformPage(const CDocumentJobPtr& job, CPageJob& page)
+{
+    if (!job->failed)
+    {
+        try
+        {
+            // A page the detector is working on is transformed once it is done, instead of holding this thread
+            if (job->detectAhead && !m_detector->startPage(job->detectAhead, page.position, [this, job, &page] { transformPage(job, page); }))
+            {
+                return;
+            }
+
+            // The analysis is kept per thread, and a page that failed on this thread may have left records behind
+            if (m_options.analyzeOnly)
+            {
+                job->converter->clearAnalysis();
+            }
+
+            // The converter is shared by all the threads, each of which wraps it in its own ICustomTransform
+            const auto start = std::chrono::steady_clock::now();
+            ICustomTransformPtr colorTransform = ICustomTransform::create(m_jawsMako, job->converter.get());
+            colorTransform->transformPage(page.page);
+            page.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            if (m_options.analyzeOnly)
+            {
+                job->analysis[page.pageIndex] = { page.pageIndex + 1, job->converter->getAnalysis() };
+                job->converter->clearAnalysis();
+            }
+        }
+        catch (...)
+        {
+            fail(*job);
+        }
+    }
+
+    if (--job->remaining == 0)
+    {
+        writeDocument(job);
+    }
+}
+
+void CBatchConverter::writeDocument(const CDocumentJobPtr& job)
+{
+    if (!job->failed)
+    {
+        try
+        {
+            job->converter->clearCaches();
+
+            if (m_options.analyzeOnly)
+            {
+                // Report only; the document is not written
+                if (job->outputStream)
+                {
+                    std::ostringstream report;
+                    writeAnalysisReport(report, job->inputFile, job->analysis);
+                    const std::string text = report.str();
+                    const int32 length = static_cast<int32>(text.size());
+                    if (!job->outputStream->open() || job->outputStream->write(text.data(), length) != length || !job->outputStream->flush())
+                    {
+                        throwEDLError(JM_ERR_GENERAL, L"Unable to write the output stream");
+                    }
+                    job->outputStream->close();
+                }
+                else if (job->outputFile == "*")
+                {
+                    std::lock_guard<std::mutex> lock(m_resultMutex);
+                    writeAnalysisReport(std::cout, job->inputFile, job->analysis);
+                }
+                else
+                {
+                    std::ofstream report(job->outputFile);
+                    if (!report.is_open())
+                    {
+                        throwEDLError(JM_ERR_GENERAL, L"Unable to open the output file");
+                    }
+                    writeAnalysisReport(report, job->inputFile, job->analysis);
+                    report.flush();
+                    if (!report.good())
+                    {
+                        throwEDLError(JM_ERR_GENERAL, L"Unable to write the output file");
+                    }
+                }
+            }
+            else if (job->outputStream)
+            {
+                const IOutputPtr output = IOutput::create(m_jawsMako, eFFPDF);
+                output->writeAssembly(job->assembly, job->outputStream);
+                if (!job->outputStream->flush())
+                {
+                    throwEDLError(JM_ERR_GENERAL, L"Unable to write the output stream");
+                }
+            }
+            else
+            {
+                const IOutputPtr output = IOutput::create(m_jawsMako, eFFPDF);
+                output->writeAssembly(job->assembly, job->outputFile.c_str());
+
+                if (m_cache && !job->cacheKey.empty())
+                {
+                    m_cache->store(job->cacheKey, job->outputFile);
+                }
+            }
+        }
+        catch (...)
+        {
+            fail(*job);
+        }
+    }
+
+    finishDocument(job);
+}
+
+// Report the outcome, and release the document and its share of the memory budget
+void CBatchConverter::finishDocument(const CDocumentJobPtr& job)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_resultMutex);
+
+        if (job->converter)
+        {
+            const CTransformStats stats = job->converter->getStats();
+            m_stats.nodesVisited += stats.nodesVisited;
+            m_stats.genericDescents += stats.genericDescents;
+            m_stats.genericDescentsSkipped += stats.genericDescentsSkipped;
+            m_stats.imagesFromIndex += stats.imagesFromIndex;
+            m_stats.imagesDetectedAhead += stats.imagesDetectedAhead;
+        }
+        for (const CPageJob& page : job->pages)
+        {
+            m_pageCosts.emplace_back(page.estimate, page.seconds);
+        }
+
+        if (job->error)
+        {
+            const std::wstring name = fs::path(job->inputFile).wstring();
+            std::wostringstream message;
+            int exitCode = 1;
+            try
+            {
+                std::rethrow_exception(job->error);
+            }
+            catch (IError& e)
+            {
+                const String errorFormatString = getEDLErrorString(e.getErrorCode());
+                message << L"Exception thrown converting " << name << L": " << e.getErrorDescription(errorFormatString);
+                exitCode = static_cast<int>(e.getErrorCode());
+            }
+            catch (std::exception& e)
+            {
+                message << L"std::exception thrown converting " << name << L": " << e.what();
+            }
+            catch (...)
+            {
+                message << L"Unknown exception converting " << name;
+            }
+            if (m_reportErrors)
+            {
+                std::wcerr << message.str() << std::endl;
+            }
+            if (!m_exitCode)
+            {
+                m_exitCode = exitCode;
+                m_firstError = message.str();
+            }
+        }
+    }
+
+    // Drop the document before letting the next one in
+    if (job->detectAhead)
+    {
+        m_detector->removeDocument(job->detectAhead);
+        job->detectAhead.reset();
+    }
+    job->pages.clear();
+    job->converter.reset();
+    job->assembly = IDocumentAssemblyPtr();
+    job->inputStream = IRAInputStreamPtr();
+    job->outputStream = IOutputStreamPtr();
+    m_budget.release(job->budgetBytes);
+}
+
+// Record the exception being handled as the document's error
+void CBatchConverter::fail(CDocumentJob& job)
+{
+    std::lock_guard<std::mutex> lock(job.errorMutex);
+    if (!job.error)
+    {
+        job.error = std::current_exception();
+    }
+    job.failed = true;
+}
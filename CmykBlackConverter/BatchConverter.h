@@ -0,0 +1,131 @@
+/* -----------------------------------------------------------------------
+ *  <copyright file="BatchConverter.h" company="Global Graphics Software Ltd">
+ *      Copyright (c) 2023 Global Graphics Software Ltd. All rights reserved.
+ *  </copyright>
+ *  <summary>
+ *  This example is provided on an "as is" basis and without warranty of any kind.
+ *  Global Graphics Software Ltd. does not warrant or make any representations regarding the use or
+ *  results of use of this example.
+ *  </summary>
+ * -----------------------------------------------------------------------
+ */
+
+#pragma once
+
+#include <atomic>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <jawsmako/jawsmako.h>
+
+#include "CmykBlackConverter.h"
+#include "LookAheadDetector.h"
+#include "ResultCache.h"
+#include "TaskScheduler.h"
+
+using namespace JawsMako;
+
+// Per-page results of an analysis-only run
+struct CPageAnalysis
+{
+    uint32 pageNumber;
+    CRichBlackObjectVect objects;
+};
+
+// Write the analysis as a JSON report. Bounds are given as [x, y, width, height].
+void writeAnalysisReport(std::ostream& out, const std::string& inputFile, const std::vector<CPageAnalysis>& pages);
+
+// Converts any number of documents on one work-stealing pool. Each document goes through the pool as a chain of
+// tasks: it is opened, the cost of each page is estimated, the pages are transformed most expensive first, and
+// the document is written when its last page is done. Large images on those pages are converted in bands on the
+// same pool. Since every task can run on any thread, a batch of one huge page and thousands of small ones keeps
+// all the threads busy to the end.
+//
+// The memory budget limits the total input size of the documents in flight. Adding a document waits until it fits.
+class CBatchConverter
+{
+public:
+    // Zero threads means one per hardware thread; zero bytes means no limit
+    CBatchConverter(const IJawsMakoPtr& jawsMako, const CCmykBlackConverterOptions& options, uint32 numThreads, uint64 maxInFlightBytes);
+    ~CBatchConverter();
+
+    // Look for each document in a result cache before converting it, and store the results there.
+    // The settings are those for the cache key.
+    void setResultCache(CResultCache* cache, const std::string& settings);
+
+    // Start converting a document. In analysis-only mode the output is the JSON report, or "*" for stdout.
+    void add(const std::string& inputFile, const std::string& outputFile);
+
+    // Start converting a document read from input instead of inputFile, and written to output instead of outputFile,
+    // for each stream that is not null. The input file name still stands for the document in errors and in the
+    // analysis report. The result cache is only used for files.
+    void add(const std::string& inputFile, const std::string& outputFile, const IRAInputStreamPtr& input, const IOutputStreamPtr& output);
+
+    // Read input files through a memory mapping instead of the SDK's file reads
+    void setMapInput(bool mapInput) { m_mapInput = mapInput; }
+
+    // Decode the images on up to this many pages ahead of the pages being transformed, on a thread of its own.
+    // Zero, the default, leaves the decoding to the transform. Set before adding any documents.
+    void setDetectAheadDepth(uint32 depth);
+
+    // Report errors on stderr as each document fails (the default), or only keep them for getFirstError()
+    void setReportErrors(bool reportErrors) { m_reportErrors = reportErrors; }
+
+    // Wait for every document to be done. Returns 0 if all succeeded, otherwise the error code of the first failure.
+    int finish();
+
+    // Forget the outcome and statistics of the documents finished so far, to start another batch on the same
+    // threads. Call once finish() has returned.
+    void reset();
+
+    // The message for the first failure, if any
+    std::wstring getFirstError() const;
+
+    uint32 numThreads() const { return m_pool.numThreads(); }
+
+    // Work done by the documents finished so far
+    CTransformStats getStats() const;
+    uint32 getCacheHits() const { return m_cacheHits; }
+    double getTransformSeconds() const;
+
+    // How far each page's share of the estimated cost was from its share of the transform time, summed over
+    // the pages, as a fraction of the total time
+    double getEstimateError() const;
+
+private:
+    struct CPageJob;
+    struct CDocumentJob;
+    typedef std::shared_ptr<CDocumentJob> CDocumentJobPtr;
+
+    void openDocument(const CDocumentJobPtr& job);
+    void estimatePage(const CDocumentJobPtr& job, CPageJob& page);
+    void transformPages(const CDocumentJobPtr& job);
+    void transformPage(const CDocumentJobPtr& job, CPageJob& page);
+    void writeDocument(const CDocumentJobPtr& job);
+    void finishDocument(const CDocumentJobPtr& job);
+    void fail(CDocumentJob& job);
+
+    const IJawsMakoPtr m_jawsMako;
+    CCmykBlackConverterOptions m_options;
+    CResultCache* m_cache;
+    std::string m_cacheSettings;
+    bool m_mapInput;
+    bool m_reportErrors;
+    CMemoryBudget m_budget;
+    std::unique_ptr<CLookAheadDetector> m_detector;
+
+    mutable std::mutex m_resultMutex;   // For everything below, and for the output streams
+    CTransformStats m_stats;
+    std::vector<std::pair<uint64, double>> m_pageCosts;  // Estimated and actual, for every page transformed
+    std::atomic<uint32> m_cacheHits;
+    int m_exitCode;
+    std::wstring m_firstError;
+
+    // Last, so that it is stopped before anything its tasks use is destroyed
+    CWorkStealingPool m_pool;
+};
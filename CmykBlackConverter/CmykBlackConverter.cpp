@@ -12,12 +12,159 @@
 
 #include "CmykBlackConverter.h"
 
+#include <algorithm>
+#include <limits>
+#include <memory>
+
+#include "ImageSpill.h"
+#include "MemoryStreams.h"
+
+// Converted images at least this large are compressed on a worker thread
+static const size_t asyncEncodeThreshold = 1024 * 1024;
+
+// The most image data queued for the compression thread
+static const size_t asyncEncodeQueueBytes = 4 * 1024 * 1024;
+
+// Used when DCT re-encoding and the source quality cannot be determined
+static const uint8 defaultJpegQuality = 90;
+
+// Images are read, converted and written this many bytes of rows at a time
+static const size_t scanlineBlockBytes = 256 * 1024;
+
+// Images at least this large are decoded on a worker thread, this many blocks ahead of the conversion
+static const size_t asyncDecodeThreshold = 1024 * 1024;
+static const uint32 asyncDecodeBlocks = 3;
+
+// With a task pool, a block of rows is converted in bands of at least this many bytes
+static const size_t minBandBytes = 64 * 1024;
+
+// Per-thread scratch space for image conversion. Buffers only ever grow, to the largest size needed so far,
+// so once a thread has warmed up converting an image does not allocate.
+struct CScratchBuffers
+{
+    std::vector<uint8> sourceBlock;
+    CEDLSimpleBuffer outBlock;
+    std::vector<const uint8*> outRows;
+    CEDLSimpleBuffer zeroScanline;
+    CEDLSimpleBuffer streamBuffer;
+    std::vector<uint8> encodeQueue;
+    std::vector<uint64> fullInkRows;
+};
+static thread_local CScratchBuffers scratch;
+
+// Rich black objects found by this thread in analysis-only mode
+static thread_local CRichBlackObjectVect threadAnalysis;
+
+static uint8* reserveScratch(CEDLSimpleBuffer& buffer, size_t size)
+{
+    if (buffer.size() < size)
+    {
+        buffer.resize(size);
+    }
+    return &buffer[0];
+}
+
+// Row bitmaps: one bit per row of an image
+static void resizeRowMap(std::vector<uint64>& rowMap, uint32 height)
+{
+    rowMap.assign((height + 63) / 64, 0);
+}
+
+static inline void setRow(std::vector<uint64>& rowMap, uint32 row)
+{
+    rowMap[row >> 6] |= (uint64) 1 << (row & 63);
+}
+
+static inline bool rowIsSet(const std::vector<uint64>& rowMap, uint32 row)
+{
+    return (rowMap[row >> 6] >> (row & 63)) & 1;
+}
+
+// Per-row kernels, for 8 (uint8) or 16 (uint16) bps CMYK data with an optional extra channel
+
+enum eRowInk
+{
+    eRINoFullInk,       // No pixel has full K, so the conversion leaves the row unchanged (in CMYK mode)
+    eRIFlatBlack,       // Some pixels have full K, but none are rich black
+    eRIRichBlack
+};
+
+template <typename T>
+static eRowInk classifyRow(const T* row, uint32 width, uint8 numChannels)
+{
+    const T full = std::numeric_limits<T>::max();
+    eRowInk ink = eRINoFullInk;
+    for (uint32 x = 0, end = width * numChannels; x < end; x += numChannels)
+    {
+        if (row[x + 3] == full)
+        {
+            if (row[x] != 0 || row[x + 1] != 0 || row[x + 2] != 0)
+            {
+                return eRIRichBlack;
+            }
+            ink = eRIFlatBlack;
+        }
+    }
+    return ink;
+}
+
+// Convert rich black to flat black in place
+template <typename T>
+static void convertRowToFlatBlack(T* row, uint32 width, uint8 numChannels)
+{
+    const T full = std::numeric_limits<T>::max();
+    for (uint32 x = 0, end = width * numChannels; x < end; x += numChannels)
+    {
+        if (row[x + 3] == full)
+        {
+            row[x] = row[x + 1] = row[x + 2] = 0;
+        }
+    }
+}
+
+// Full K becomes a set bit in a 1 bps mask
+template <typename T>
+static void convertRowToMask(const T* row, uint8* out, uint32 width, uint8 numChannels)
+{
+    const T full = std::numeric_limits<T>::max();
+    memset(out, 0, (width + 7) / 8);
+    for (uint32 x = 0, pixel = 0; pixel < width; x += numChannels, pixel++)
+    {
+        if (row[x + 3] == full)
+        {
+            out[pixel >> 3] |= 0x80 >> (pixel & 7);
+        }
+    }
+}
+
+// Full K becomes full ink on the single DeviceN channel, followed by the extra channel as is
+template <typename T>
+static void convertRowToDeviceN(const T* row, T* out, uint32 width, uint8 numChannels)
+{
+    const T full = std::numeric_limits<T>::max();
+    for (uint32 x = 0, pixel = 0; pixel < width; x += numChannels, pixel++)
+    {
+        out[pixel * 2] = row[x + 3] == full ? full : 0;
+        out[pixel * 2 + 1] = row[x + 4];
+    }
+}
+
 // A transform to convert rich black (CMYK with K=1.0 and some ink on the other channels)
 // to flat black (C=0, M=0, Y=0, K=1.0).
-CCmykBlackConverterImplementation::CCmykBlackConverterImplementation(const IJawsMakoPtr& jawsMako, bool useDeviceN, bool doNotApplyOverprint) :
-                                                                     m_jawsMako(jawsMako), m_useDeviceN(useDeviceN), m_doNotApplyOverprint(doNotApplyOverprint)
+// In analysis-only mode nothing is changed; rich black objects are recorded instead.
+CCmykBlackConverterImplementation::CCmykBlackConverterImplementation(const IJawsMakoPtr& jawsMako, const CCmykBlackConverterOptions& options) :
+                                                                     m_jawsMako(jawsMako), m_useDeviceN(options.useDeviceN), m_doNotApplyOverprint(options.doNotApplyOverprint),
+                                                                     m_analyzeOnly(options.analyzeOnly), m_imageEncoding(options.imageEncoding), m_jpegQuality(options.jpegQuality),
+                                                                     m_maxImageMemory(options.maxImageMemory), m_taskPool(options.taskPool),
+                                                                     m_nodesVisited(0), m_genericDescents(0), m_genericDescentsSkipped(0),
+                                                                     m_imagesFromIndex(0), m_imagesDetectedAhead(0)
 {
-    if (useDeviceN)
+    if (!options.imageIndex.empty())
+    {
+        m_imageIndex.reset(new CImageIndex(options.imageIndex));
+    }
+
+    if (m_useDeviceN)
     {
         const auto deviceNColorSpace = makeNewDeviceNColorSpace("FlatBlack", { 0.0f, 0.0f, 0.0f, 1.0f });
         m_flatBlackColorSpace = edlobj2IDOMColorSpace(deviceNColorSpace);
@@ -30,16 +177,75 @@ CCmykBlackConverterImplementation::CCmykBlackConverterImplementation(const IJaws
     }
 }
 
+// Only tiling patterns, masked brushes and visual brushes have content of their own that the generic
+// implementation needs to descend into. Anything else has been dealt with completely by transformBrush().
+static bool brushHasContent(const IDOMBrushPtr& brush)
+{
+    if (!brush)
+    {
+        return false;
+    }
+
+    switch (brush->getBrushType())
+    {
+    case IDOMBrush::eTilingPattern:
+    case IDOMBrush::eMasked:
+    case IDOMBrush::eVisual:
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+CTransformStats CCmykBlackConverterImplementation::getStats() const
+{
+    CTransformStats stats;
+    stats.nodesVisited = m_nodesVisited;
+    stats.genericDescents = m_genericDescents;
+    stats.genericDescentsSkipped = m_genericDescentsSkipped;
+    stats.imagesFromIndex = m_imagesFromIndex;
+    stats.imagesDetectedAhead = m_imagesDetectedAhead;
+    return stats;
+}
+
+const CRichBlackObjectVect& CCmykBlackConverterImplementation::getAnalysis() const
+{
+    return threadAnalysis;
+}
+
+void CCmykBlackConverterImplementation::clearAnalysis() const
+{
+    threadAnalysis.clear();
+}
+
 IDOMNodePtr CCmykBlackConverterImplementation::transformGlyphs(IImplementation* genericImplementation, const IDOMGlyphsPtr& glyphs, bool& changed, const CTransformState& state)
 {
-    // Transform the fill, if present
-    bool alteredFill = transformFill(glyphs);
-    if (alteredFill)
+    m_nodesVisited++;
+
+    if (m_analyzeOnly)
+    {
+        recordRichBlack(glyphs, glyphs->getFill(), CRichBlackObject::eGlyphs, state);
+    }
+    else
     {
-        changed = true;
+        // Transform the fill, if present
+        bool alteredFill = transformFill(glyphs);
+        if (alteredFill)
+        {
+            changed = true;
+        }
     }
 
-    // Perform generic processing in case something needs to change inside complex brushes (eg patterns)
+    // Perform generic processing in case something needs to change inside complex brushes (eg patterns).
+    // Most glyphs have a solid fill, for which there is nothing more to do.
+    if (!brushHasContent(glyphs->getFill()))
+    {
+        m_genericDescentsSkipped++;
+        return glyphs;
+    }
+
+    m_genericDescents++;
     bool didSomething = false;
     IDOMNodePtr result = genericImplementation->transformGlyphs(NULL, glyphs, didSomething, state);
     changed |= didSomething;
@@ -48,15 +254,32 @@ IDOMNodePtr CCmykBlackConverterImplementation::transformGlyphs(IImplementation*
 
 IDOMNodePtr CCmykBlackConverterImplementation::transformPath(IImplementation* genericImplementation, const IDOMPathNodePtr& path, bool& changed, const CTransformState& state)
 {
-    // Transform the fill, if present
-    bool alteredFill = transformFill(path);
-    bool alteredStroke = transformStroke(path);
-    if (alteredFill || alteredStroke)
+    m_nodesVisited++;
+
+    if (m_analyzeOnly)
     {
-        changed = true;
+        recordRichBlack(path, path->getFill(), CRichBlackObject::eFill, state);
+        recordRichBlack(path, path->getStroke(), CRichBlackObject::eStroke, state);
+    }
+    else
+    {
+        // Transform the fill, if present
+        bool alteredFill = transformFill(path);
+        bool alteredStroke = transformStroke(path);
+        if (alteredFill || alteredStroke)
+        {
+            changed = true;
+        }
     }
 
     // Perform generic processing in case something needs to change inside complex brushes (eg patterns)
+    if (!brushHasContent(path->getFill()) && !brushHasContent(path->getStroke()))
+    {
+        m_genericDescentsSkipped++;
+        return path;
+    }
+
+    m_genericDescents++;
     bool didSomething = false;
     IDOMNodePtr result = genericImplementation->transformPath(NULL, path, didSomething, state);
     changed |= didSomething;
@@ -70,6 +293,8 @@ IDOMNodePtr CCmykBlackConverterImplementation::transformCharPathGroup(IImplement
     bool& changed, bool transformChildren,
     const CTransformState& state)
 {
+    m_nodesVisited++;
+
     // Ok - what situation are we dealing with here?
     if (group->getCharPathType() == IDOMCharPathGroup::eCharPath_Stroke)
     {
@@ -82,8 +307,11 @@ IDOMNodePtr CCmykBlackConverterImplementation::transformCharPathGroup(IImplement
         }
 
         // Attempt to transform the stroke brush
-        bool alteredStroke = transformStroke(path);
-        if (alteredStroke)
+        if (m_analyzeOnly)
+        {
+            recordRichBlack(path, path->getStroke(), CRichBlackObject::eGlyphs, state.stateInsideNode(group));
+        }
+        else if (transformStroke(path))
         {
             changed = true;
         }
@@ -95,8 +323,9 @@ IDOMNodePtr CCmykBlackConverterImplementation::transformCharPathGroup(IImplement
         // composite brushes containing content we need to process.
         // For our purposes also there is no need to update the state, but we do so anyway as a matter of discipline.
         IDOMBrushPtr stroke = path->getStroke();
-        if (stroke)
+        if (brushHasContent(stroke))
         {
+            m_genericDescents++;
             CTransformState pathState = state.stateInsideNode(path);
             IDOMBrushPtr transformed = genericImplementation->transformBrush(nullptr, stroke, eBUStroke, pathState);
             if (transformed != stroke)
@@ -105,6 +334,10 @@ IDOMNodePtr CCmykBlackConverterImplementation::transformCharPathGroup(IImplement
                 path->setStroke(transformed);
             }
         }
+        else if (stroke)
+        {
+            m_genericDescentsSkipped++;
+        }
     }
     else
     {
@@ -135,7 +368,7 @@ IDOMNodePtr CCmykBlackConverterImplementation::transformCharPathGroup(IImplement
 
 // Template routine to process a fill
 template <class T>
-bool CCmykBlackConverterImplementation::transformFill(const T& node)
+bool CCmykBlackConverterImplementation::transformFill(const T& node) const
 {
     IDOMBrushPtr oldBrush = node->getFill();
     IDOMBrushPtr newBrush = transformBrush(oldBrush);
@@ -158,7 +391,7 @@ bool CCmykBlackConverterImplementation::transformFill(const T& node)
 // Template routine to process a stroke. This one need not be a template
 // (only applies to paths) but let's be consistent...
 template <class T>
-bool CCmykBlackConverterImplementation::transformStroke(const T& node)
+bool CCmykBlackConverterImplementation::transformStroke(const T& node) const
 {
     IDOMBrushPtr oldBrush = node->getStroke();
     IDOMBrushPtr newBrush = transformBrush(oldBrush);
@@ -192,13 +425,9 @@ IDOMBrushPtr CCmykBlackConverterImplementation::transformBrush(const IDOMBrushPt
     case IDOMBrush::eSolidColor:
     {
         IDOMSolidColorBrushPtr solid = edlobj2IDOMSolidColorBrush(brush);
-        IDOMColorPtr oldColor = solid->getColor();
-        IDOMColorPtr newColor = transformColor(oldColor);
-        if (oldColor != newColor)
+        if (colorIsCmykRichBlack(solid->getColor()))
         {
-            solid = EDL::clone(solid, m_jawsMako);
-            solid->setColor(newColor);
-            brush = solid;
+            brush = internFlatBlackBrush(solid);
         }
     }
     break;
@@ -235,7 +464,7 @@ IDOMBrushPtr CCmykBlackConverterImplementation::transformBrush(const IDOMBrushPt
     case IDOMBrush::eTilingPattern:
     {
         IDOMTilingPatternBrushPtr tiling = edlobj2IDOMTilingPatternBrush(brush);
-        if (tiling->getPaintType() == 2)
+        if (tiling->getPaintType() == 2 && !findCachedBrush(m_patternColorCache, inBrush, brush))
         {
             IDOMColorPtr oldColor = tiling->getPatternColor();
             IDOMColorPtr newColor = transformColor(oldColor);
@@ -245,6 +474,28 @@ IDOMBrushPtr CCmykBlackConverterImplementation::transformBrush(const IDOMBrushPt
                 tiling->setPatternColor(newColor);
                 brush = tiling;
             }
+            brush = cacheBrush(m_patternColorCache, inBrush, brush);
+        }
+    }
+    break;
+
+    case IDOMBrush::eLinearGradient:
+        brush = transformGradient(edlobj2IDOMLinearGradientBrush(brush));
+        break;
+
+    case IDOMBrush::eRadialGradient:
+        brush = transformGradient(edlobj2IDOMRadialGradientBrush(brush));
+        break;
+
+    case IDOMBrush::eShadingPattern:
+    {
+        IDOMShadingPatternBrushPtr shadingBrush = edlobj2IDOMShadingPatternBrush(brush);
+        IDOMShadingPtr newShading;
+        if (transformShading(shadingBrush->getShading(), &newShading))
+        {
+            shadingBrush = EDL::clone(shadingBrush, m_jawsMako);
+            shadingBrush->setShading(newShading);
+            brush = shadingBrush;
         }
     }
     break;
@@ -255,236 +506,1073 @@ IDOMBrushPtr CCmykBlackConverterImplementation::transformBrush(const IDOMBrushPt
     return brush;
 }
 
-// Get an image frame, applying a BitScaler filter if required.
-IDOMImagePtr CCmykBlackConverterImplementation::getFilteredImage(const IDOMImagePtr &inImage, uint8 bps) const
+// Called by the generic implementation for every brush it descends into. For tiling patterns, the descent
+// into the pattern cell is done once per pattern and the result shared by all its uses. In analysis-only mode
+// every use is descended into, so that the objects in the cell are recorded for each use, at its place.
+IDOMBrushPtr CCmykBlackConverterImplementation::transformBrush(IImplementation* genericImplementation, const IDOMBrushPtr& brush,
+                                                               eBrushUsage usage, const CTransformState& state)
 {
-    IDOMImagePtr image = inImage;
-
-    switch (bps)
+    if (!brush || brush->getBrushType() != IDOMBrush::eTilingPattern || m_analyzeOnly)
     {
-        case 1:
-        case 2:
-        case 4:
-            bps = 8;
-            break;
-
-        case 12:
-            bps = 16;
-            break;
+        return genericImplementation->transformBrush(nullptr, brush, usage, state);
+    }
 
-        case 8:
-        case 16:
-            return image;
+    IDOMBrushPtr result;
+    if (!findCachedBrush(m_patternCellCache, brush, result))
+    {
+        result = genericImplementation->transformBrush(nullptr, brush, usage, state);
+        result = cacheBrush(m_patternCellCache, brush, result);
+    }
+    return result;
+}
 
-        default:
-            throwEDLError(JM_ERR_GENERAL, L"Unsupported BPS");
+bool CCmykBlackConverterImplementation::findCachedBrush(const CBrushCache& cache, const IDOMBrushPtr& source, IDOMBrushPtr& result) const
+{
+    std::lock_guard<std::mutex> lock(m_cacheMutex);
+    auto found = cache.find(&*source);
+    if (found == cache.end())
+    {
+        return false;
     }
+    result = found->second.second;
+    return true;
+}
 
-    IDOMImageBitScalerFilterPtr scaler = IDOMImageBitScalerFilter::create(m_jawsMako, bps);
-    return IDOMFilteredImage::create(m_jawsMako, image, scaler);
+// Returns the cached result. If two threads transformed the same pattern at once, this is the first one's.
+IDOMBrushPtr CCmykBlackConverterImplementation::cacheBrush(CBrushCache& cache, const IDOMBrushPtr& source, const IDOMBrushPtr& result) const
+{
+    std::lock_guard<std::mutex> lock(m_cacheMutex);
+    return cache.emplace(&*source, std::make_pair(source, result)).first->second.second;
 }
 
-IDOMImagePtr CCmykBlackConverterImplementation::transformImage(const IDOMImagePtr &inImage) const
+void CCmykBlackConverterImplementation::clearCaches() const
 {
-    IDOMImagePtr image = inImage;
+    std::lock_guard<std::mutex> lock(m_cacheMutex);
+    m_patternColorCache.clear();
+    m_patternCellCache.clear();
+    m_detectedImages.clear();
+    m_flatBlackBrushes.clear();
+    m_flatBlackCmykColors.clear();
+}
 
-    IImageFramePtr frame = image->getImageFrame(m_jawsMako);
+// The flat black replacement for a rich black solid brush, shared by all brushes of the same opacity
+IDOMBrushPtr CCmykBlackConverterImplementation::internFlatBlackBrush(const IDOMSolidColorBrushPtr& source) const
+{
+    std::lock_guard<std::mutex> lock(m_cacheMutex);
 
-    IDOMColorSpacePtr colorSpace = frame->getColorSpace();
+    IDOMBrushPtr& interned = m_flatBlackBrushes[source->getOpacity()];
+    if (!interned)
+    {
+        IDOMSolidColorBrushPtr solid = EDL::clone(source, m_jawsMako);
+        solid->setColor(m_flatBlack);
+        interned = solid;
+    }
+    return interned;
+}
 
-    // Is the space CMYK?
-    if (!edlobj2IDOMColorSpaceDeviceCMYK(colorSpace))
+// CMYK flat black of the given alpha, as used for gradient stops
+IDOMColorPtr CCmykBlackConverterImplementation::internFlatBlackCmyk(float alpha) const
+{
+    std::lock_guard<std::mutex> lock(m_cacheMutex);
+
+    IDOMColorPtr& interned = m_flatBlackCmykColors[alpha];
+    if (!interned)
     {
-        return image;
+        interned = IDOMColor::createSolidCmyk(m_jawsMako, 0.0f, 0.0f, 0.0f, 1.0f, alpha);
     }
+    return interned;
+}
 
-    // If the image is not 8 or 16 bps filter it.
-    IDOMImagePtr filteredImage = getFilteredImage(inImage, frame->getBPS());
+// Template routine to process a linear or radial gradient, stop by stop
+template <class T>
+IDOMBrushPtr CCmykBlackConverterImplementation::transformGradient(const T& gradient) const
+{
+    IDOMGradientStopCollectionPtr newStops;
+    if (!transformGradientStops(gradient->getGradientStops(), &newStops))
+    {
+        return gradient;
+    }
 
-    frame = filteredImage->getImageFrame(m_jawsMako);
+    T newGradient = EDL::clone(gradient, m_jawsMako);
+    newGradient->setGradientStops(newStops);
+    return newGradient;
+}
 
-    uint8 numChannels = colorSpace->getNumComponents();
+// Convert rich black gradient stops. The stops are interpolated in a single color space, so in DeviceN mode too
+// they become CMYK flat black, keeping their alpha. With newStops null this only checks for rich black.
+bool CCmykBlackConverterImplementation::transformGradientStops(const IDOMGradientStopCollectionPtr& stops, IDOMGradientStopCollectionPtr* newStops) const
+{
+    if (!stops)
+    {
+        return false;
+    }
 
-    eImageExtraChannelType extraChannelType = frame->getExtraChannelType();
-    if (extraChannelType != eIECNone)
+    bool changed = false;
+    for (uint32 i = 0; i < stops->getSize() && !(changed && !newStops); i++)
     {
-        // It may have an extra channel.
-        numChannels += 1;
+        changed |= colorIsCmykRichBlack(stops->getStop(i)->getColor());
+    }
+    if (!changed || !newStops)
+    {
+        return changed;
     }
 
-    if (numChannels < 4)
+    *newStops = IDOMGradientStopCollection::create(m_jawsMako);
+    for (uint32 i = 0; i < stops->getSize(); i++)
     {
-        // Shouldn't happen.
-        return image;
+        IDOMGradientStopPtr stop = stops->getStop(i);
+        IDOMColorPtr color = stop->getColor();
+        if (colorIsCmykRichBlack(color))
+        {
+            stop = IDOMGradientStop::create(m_jawsMako, internFlatBlackCmyk((float) color->getAlpha()), stop->getOffset());
+        }
+        (*newStops)->append(stop);
     }
-    
-    // Get the new BPS.
-    uint8 bps = frame->getBPS();
+    return true;
+}
 
-    uint32 width = frame->getWidth();
-    uint32 height = frame->getHeight();
+// Convert a DeviceCMYK shading by converting the function that gives its colors. Shadings without a function
+// (meshes with colors given per vertex) are not available for rewriting through the DOM and are left alone.
+// With newShading null this only checks for rich black.
+bool CCmykBlackConverterImplementation::transformShading(const IDOMShadingPtr& shading, IDOMShadingPtr* newShading) const
+{
+    if (!shading || !edlobj2IDOMColorSpaceDeviceCMYK(shading->getColorSpace()))
+    {
+        return false;
+    }
+
+    IDOMFunctionPtr newFunction;
+    if (!transformFunction(shading->getFunction(), newShading ? &newFunction : nullptr))
+    {
+        return false;
+    }
 
-    CEDLSimpleBuffer scanline;
-    scanline.resize(frame->getRawBytesPerRow());
+    if (newShading)
+    {
+        *newShading = EDL::clone(shading, m_jawsMako);
+        (*newShading)->setFunction(newFunction);
+    }
+    return true;
+}
 
-    // First see if we need to convert.
-    bool richBlack = false;
+// Convert the rich black outputs of a CMYK shading function: the end points of an exponential function, the
+// samples of a sampled function, and the sub-functions of a stitching function. Other functions are left alone.
+// Sampled function outputs are found through their Decode and Range. With newFunction null this only checks for
+// rich black.
+bool CCmykBlackConverterImplementation::transformFunction(const IDOMFunctionPtr& function, IDOMFunctionPtr* newFunction) const
+{
+    if (!function)
+    {
+        return false;
+    }
 
-    if (bps != 8)
+    IDOMExponentialFunctionPtr exponential = edlobj2IDOMExponentialFunction(function);
+    if (exponential)
     {
-        if (bps != 16)
+        CFloatVect c0 = exponential->getC0();
+        CFloatVect c1 = exponential->getC1();
+        bool changed = false;
+        for (CFloatVect* c : { &c0, &c1 })
+        {
+            if (c->size() == 4 && (*c)[3] == 1.0f && ((*c)[0] != 0.0f || (*c)[1] != 0.0f || (*c)[2] != 0.0f))
+            {
+                (*c)[0] = (*c)[1] = (*c)[2] = 0.0f;
+                changed = true;
+            }
+        }
+        if (changed && newFunction)
         {
-            throwEDLError(JM_ERR_GENERAL, L"Unexpected BPS");
+            IDOMExponentialFunctionPtr converted = EDL::clone(exponential, m_jawsMako);
+            converted->setC0(c0);
+            converted->setC1(c1);
+            *newFunction = converted;
         }
+        return changed;
+    }
 
-        // Do we need to handle this?
-        for (uint32 y = 0; y < height; y++)
+    IDOMSampledFunctionPtr sampled = edlobj2IDOMSampledFunction(function);
+    if (sampled)
+    {
+        uint8 bps = sampled->getBitsPerSample();
+        if (sampled->getNumOutputs() != 4 || (bps != 8 && bps != 16))
         {
-            frame->readScanLine(&scanline[0], scanline.size());
+            return false;
+        }
 
-            uint16 *ptr = (uint16 *) &scanline[0];
+        // Each sample is mapped to an output through the Decode array (by default the Range), then clipped to the
+        // Range and to the color space. Only an output of exactly 1.0 is full K.
+        const CFloatVect range = sampled->getRange();
+        CFloatVect decode = sampled->getDecode();
+        if (decode.empty())
+        {
+            decode = range;
+        }
+        if (range.size() != 8 || decode.size() != 8)
+        {
+            return false;
+        }
 
-            for (uint32 x = 0; x < scanline.size() / 2; x += numChannels)
+        const uint32 maxSample = bps == 8 ? 0xFF : 0xFFFF;
+        auto output = [&](uint32 channel, uint32 sample)
+        {
+            const double low = decode[channel * 2];
+            const double value = low + sample * (decode[channel * 2 + 1] - low) / maxSample;
+            return std::min(std::max(std::min(std::max(value, (double) range[channel * 2]), (double) range[channel * 2 + 1]), 0.0), 1.0);
+        };
+
+        // The sample that gives no ink on each of C, M and Y. Without one there is no way to write flat black.
+        uint32 noInk[3];
+        for (uint32 channel = 0; channel < 3; channel++)
+        {
+            const double low = decode[channel * 2];
+            const double high = decode[channel * 2 + 1];
+            const uint32 exact = high != low ? (uint32) std::min(std::max(-low / (high - low) * maxSample + 0.5, 0.0), (double) maxSample) : 0;
+            bool found = false;
+            for (uint32 candidate : { 0u, maxSample, exact })
             {
-                if (ptr[x + 3] != 0xffff)
+                if (!found && output(channel, candidate) == 0.0)
                 {
-                    continue;
+                    noInk[channel] = candidate;
+                    found = true;
                 }
+            }
+            if (!found)
+            {
+                return false;
+            }
+        }
+
+        // At most a few thousand samples, so converting a copy is cheap. Samples are big endian, as in PDF.
+        CEDLSimpleBuffer samples = sampled->getSamples();
+        const uint32 sampleBytes = bps / 8;
+        auto getSample = [&](size_t index)
+        {
+            return sampleBytes == 1 ? samples[index] : (uint32) ((samples[index * 2] << 8) | samples[index * 2 + 1]);
+        };
+        auto setSample = [&](size_t index, uint32 value)
+        {
+            if (sampleBytes == 1)
+            {
+                samples[index] = (uint8) value;
+            }
+            else
+            {
+                samples[index * 2] = (uint8) (value >> 8);
+                samples[index * 2 + 1] = (uint8) value;
+            }
+        };
 
-                if (ptr[x] != 0 || ptr[x + 1] != 0 || ptr[x + 2] != 0)
+        bool changed = false;
+        const size_t count = samples.size() / (4 * sampleBytes);
+        for (size_t i = 0; i < count && !(changed && !newFunction); i++)
+        {
+            if (output(3, getSample(i * 4 + 3)) != 1.0)
+            {
+                continue;
+            }
+            for (uint32 channel = 0; channel < 3; channel++)
+            {
+                if (output(channel, getSample(i * 4 + channel)) != 0.0)
                 {
-                    richBlack = true;
-                    break;
+                    setSample(i * 4 + channel, noInk[channel]);
+                    changed = true;
                 }
             }
         }
+        if (changed && newFunction)
+        {
+            IDOMSampledFunctionPtr converted = EDL::clone(sampled, m_jawsMako);
+            converted->setSamples(samples);
+            *newFunction = converted;
+        }
+        return changed;
     }
-    else
+
+    IDOMStitchingFunctionPtr stitching = edlobj2IDOMStitchingFunction(function);
+    if (stitching)
     {
-        for (uint32 y = 0; y < height; y++)
+        CDOMFunctionVect functions = stitching->getFunctions();
+        bool changed = false;
+        for (uint32 i = 0; i < functions.size() && !(changed && !newFunction); i++)
         {
-            frame->readScanLine(&scanline[0], scanline.size());
-
-            for (uint32 x = 0; x < scanline.size(); x += numChannels)
+            IDOMFunctionPtr converted;
+            if (transformFunction(functions[i], newFunction ? &converted : nullptr))
             {
-                if (scanline[x + 3] != 0xff)
-                {
-                    continue;
-                }
-
-                if (scanline[x] != 0 || scanline[x + 1] != 0 || scanline[x + 2] != 0)
+                if (newFunction)
                 {
-                    richBlack = true;
-                    break;
+                    functions[i] = converted;
                 }
+                changed = true;
             }
         }
+        if (changed && newFunction)
+        {
+            IDOMStitchingFunctionPtr converted = EDL::clone(stitching, m_jawsMako);
+            converted->setFunctions(functions);
+            *newFunction = converted;
+        }
+        return changed;
     }
 
-    if (!richBlack)
-    {
-        // Nothing to do.
-        return image;
-    }
+    return false;
+}
 
-    // We need to convert, Get the frame again.
-    frame = filteredImage->getImageFrame(m_jawsMako);
+// Analysis-only counterpart of transformBrush(). Reports the kind of rich black use found, if any, using
+// solidType for solid colour brushes as the caller knows whether this is a fill, a stroke or text.
+bool CCmykBlackConverterImplementation::brushHasRichBlack(const IDOMBrushPtr& brush, CRichBlackObject::eObjectType solidType,
+                                                          CRichBlackObject::eObjectType& foundType) const
+{
+    if (!brush)
+    {
+        return false;
+    }
 
-    // Create a writer and image.
-    IImageFrameWriterPtr frameWriter;
-    image = IDOMRawImage::createWriterAndImage(m_jawsMako, frameWriter, m_flatBlackColorSpace, width, height, bps,
-                                               frame->getXResolution(), frame->getYResolution(), extraChannelType);
+    switch (brush->getBrushType())
+    {
+    case IDOMBrush::eSolidColor:
+        foundType = solidType;
+        return colorIsCmykRichBlack(edlobj2IDOMSolidColorBrush(brush)->getColor());
 
-    // Convert rich black to flat black.
-    if (m_useDeviceN)
+    case IDOMBrush::eImage:
+        foundType = CRichBlackObject::eImage;
+        return imageHasRichBlack(edlobj2IDOMImageBrush(brush)->getImageSource());
+
+    case IDOMBrush::eMasked:
+        return brushHasRichBlack(edlobj2IDOMMaskedBrush(brush)->getBrush(), solidType, foundType);
+
+    case IDOMBrush::eTilingPattern:
     {
-        if (bps != 8)
-        {
-            CEDLSimpleBuffer outScanline;
-            outScanline.resize(width * 2);
+        IDOMTilingPatternBrushPtr tiling = edlobj2IDOMTilingPatternBrush(brush);
+        foundType = CRichBlackObject::ePatternColor;
+        return tiling->getPaintType() == 2 && colorIsCmykRichBlack(tiling->getPatternColor());
+    }
 
-            for (uint32 y = 0; y < height; y++)
-            {
-                frame->readScanLine(&scanline[0], scanline.size());
-                uint16* ptr = (uint16*)&scanline[0];
+    case IDOMBrush::eLinearGradient:
+        foundType = solidType;
+        return transformGradientStops(edlobj2IDOMLinearGradientBrush(brush)->getGradientStops(), nullptr);
+
+    case IDOMBrush::eRadialGradient:
+        foundType = solidType;
+        return transformGradientStops(edlobj2IDOMRadialGradientBrush(brush)->getGradientStops(), nullptr);
 
-                memset(&outScanline[0], 0, width * 2);
+    case IDOMBrush::eShadingPattern:
+        foundType = solidType;
+        return transformShading(edlobj2IDOMShadingPatternBrush(brush)->getShading(), nullptr);
 
-                for (uint32 x = 0; x < scanline.size() / 2; x += numChannels)
+    default:
+        return false;
+    }
+}
+
+// Record a node in the analysis if the given brush would be changed by the transform. The node's bounds are in the
+// space of its parent, so they are taken to page space with the transform of the state, which accounts for any
+// forms, transformed groups or pattern cells the node is inside.
+void CCmykBlackConverterImplementation::recordRichBlack(const IDOMNodePtr& node, const IDOMBrushPtr& brush, CRichBlackObject::eObjectType solidType,
+                                                        const CTransformState& state) const
+{
+    CRichBlackObject::eObjectType foundType = solidType;
+    if (brushHasRichBlack(brush, solidType, foundType))
+    {
+        FRect bounds = node->getBounds();
+        state.transform.transformRect(bounds);
+        threadAnalysis.push_back({ foundType, bounds });
+    }
+}
+
+// Scan the remainder of an (8 or 16 bps) CMYK frame for rich black. Without fullInkRows, this stops at the first
+// rich black pixel. Otherwise every row is scanned, and the rows with any full K pixels (the only rows the
+// conversion has to look at) are marked in fullInkRows.
+bool CCmykBlackConverterImplementation::scanForRichBlack(const IImageFramePtr& frame, uint8 bps, uint8 numChannels, size_t rowBytes,
+                                                         std::vector<uint64>* fullInkRows) const
+{
+    if (bps != 8 && bps != 16)
+    {
+        throwEDLError(JM_ERR_GENERAL, L"Unexpected BPS");
+    }
+
+    uint32 width = frame->getWidth();
+    uint32 height = frame->getHeight();
+    bool richBlack = false;
+
+    if (fullInkRows)
+    {
+        resizeRowMap(*fullInkRows, height);
+    }
+
+    // A row that repeats the one before reuses its result. Comparing stops at the first difference, so this
+    // costs little for rows that differ.
+    const uint32 queueBlocks = rowBytes * height >= asyncDecodeThreshold ? asyncDecodeBlocks : 0;
+    CScanlineBlockReader reader(frame, rowBytes, height, scanlineBlockBytes, queueBlocks, scratch.sourceBlock);
+    eRowInk ink = eRINoFullInk;
+
+    for (uint32 numRows; (numRows = reader.readBlock()) != 0;)
+    {
+        for (uint32 i = 0; i < numRows; i++)
+        {
+            const uint32 y = reader.blockStart() + i;
+            const uint8* row = reader.row(i);
+
+            if (y == 0 || memcmp(row, reader.row(i - 1), rowBytes) != 0)
+            {
+                ink = bps != 8 ? classifyRow((const uint16*) row, width, numChannels)
+                               : classifyRow(row, width, numChannels);
+            }
+            if (ink == eRIRichBlack)
+            {
+                richBlack = true;
+                if (!fullInkRows)
                 {
-                    if (ptr[x + 3] == 0xffff)
-                    {
-                        outScanline[x / numChannels] = 0xFFFF;
-                    }
+                    return true;
                 }
-                frameWriter->writeScanLine(&outScanline[0]);
+            }
+            if (ink != eRINoFullInk && fullInkRows)
+            {
+                setRow(*fullInkRows, y);
             }
         }
-        else
+    }
+
+    return richBlack;
+}
+
+// Get the 8 or 16 bps frame of a DeviceCMYK image, filtering it if needed. Returns the (possibly filtered) image
+// the frame belongs to, or nullptr if the image is not one we can convert.
+IDOMImagePtr CCmykBlackConverterImplementation::getCmykFrame(const IDOMImagePtr& image, IImageFramePtr& frame, uint8& numChannels) const
+{
+    frame = image->getImageFrame(m_jawsMako);
+
+    // Is the space CMYK?
+    IDOMColorSpacePtr colorSpace = frame->getColorSpace();
+    if (!edlobj2IDOMColorSpaceDeviceCMYK(colorSpace))
+    {
+        return nullptr;
+    }
+
+    // If the image is not 8 or 16 bps filter it.
+    IDOMImagePtr filteredImage = getFilteredImage(image, frame->getBPS());
+    frame = filteredImage->getImageFrame(m_jawsMako);
+
+    numChannels = colorSpace->getNumComponents();
+    if (frame->getExtraChannelType() != eIECNone)
+    {
+        // It may have an extra channel.
+        numChannels += 1;
+    }
+
+    if (numChannels < 4)
+    {
+        // Shouldn't happen.
+        return nullptr;
+    }
+
+    return filteredImage;
+}
+
+// Does the image contain rich black? This is the detection pass of transformImage() on its own.
+bool CCmykBlackConverterImplementation::imageHasRichBlack(const IDOMImagePtr& image) const
+{
+    // For indexed images only the palette needs checking
+    IDOMColorSpaceIndexedPtr indexed = edlobj2IDOMColorSpaceIndexed(image->getImageFrame(m_jawsMako)->getColorSpace());
+    if (indexed)
+    {
+        if (!edlobj2IDOMColorSpaceDeviceCMYK(indexed->getBaseColorSpace()))
         {
-            CEDLSimpleBuffer outScanline;
-            outScanline.resize(width);
+            return false;
+        }
+        CEDLSimpleBuffer lookup = indexed->getLookup();
+        return transformLookup(lookup, indexed->getHiVal() + 1);
+    }
 
-            for (uint32 y = 0; y < height; y++)
-            {
-                frame->readScanLine(&scanline[0], scanline.size());
+    bool richBlack;
+    if (findDetectedImage(image, richBlack, nullptr))
+    {
+        return richBlack;
+    }
 
-                memset(&outScanline[0], 0, width);
+    IImageFramePtr frame;
+    uint8 numChannels = 0;
+    if (!getCmykFrame(image, frame, numChannels))
+    {
+        return false;
+    }
 
-                for (uint32 x = 0; x < scanline.size(); x += numChannels)
-                {
-                    if (scanline[x + 3] == 0xff)
-                    {
-                        outScanline[x / numChannels] = 0xFF;
-                    }
-                }
-                frameWriter->writeScanLine(&outScanline[0]);
-            }
+    CImageIndex::CKey imageKey;
+    const bool haveKey = m_imageIndex && getImageKey(image, frame, numChannels, imageKey);
+    if (haveKey)
+    {
+        const CImageIndex::eImageState state = m_imageIndex->lookup(imageKey, nullptr);
+        if (state != CImageIndex::eISUnknown)
+        {
+            m_imagesFromIndex++;
+            return state == CImageIndex::eISRichBlack;
         }
     }
+
+    richBlack = scanForRichBlack(frame, frame->getBPS(), numChannels, frame->getRawBytesPerRow());
+    if (haveKey)
+    {
+        m_imageIndex->store(imageKey, richBlack, frame->getHeight(), nullptr);
+    }
+    return richBlack;
+}
+
+// The detection pass of transformImage(), done ahead. The image index is still used, as hashing the encoded
+// data is cheaper than decoding it, and the result is kept either way so that the transform need do neither.
+void CCmykBlackConverterImplementation::detectImageAhead(const IDOMImagePtr& image) const
+{
+    {
+        std::lock_guard<std::mutex> lock(m_cacheMutex);
+        if (m_detectedImages.count(&*image))
+        {
+            return;
+        }
+    }
+
+    // Indexed images only have their palette checked
+    if (edlobj2IDOMColorSpaceIndexed(image->getImageFrame(m_jawsMako)->getColorSpace()))
+    {
+        return;
+    }
+
+    IImageFramePtr frame;
+    uint8 numChannels = 0;
+    if (!getCmykFrame(image, frame, numChannels))
+    {
+        return;
+    }
+
+    CDetectedImage result = { image, false, {} };
+    CImageIndex::CKey imageKey;
+    const bool haveKey = m_imageIndex && getImageKey(image, frame, numChannels, imageKey);
+    const CImageIndex::eImageState state = haveKey ? m_imageIndex->lookup(imageKey, &result.fullInkRows) : CImageIndex::eISUnknown;
+    if (state != CImageIndex::eISUnknown)
+    {
+        result.richBlack = state == CImageIndex::eISRichBlack;
+    }
     else
     {
-        if (bps != 8)
+        result.richBlack = scanForRichBlack(frame, frame->getBPS(), numChannels, frame->getRawBytesPerRow(), &result.fullInkRows);
+        if (haveKey)
+        {
+            m_imageIndex->store(imageKey, result.richBlack, frame->getHeight(), &result.fullInkRows);
+        }
+    }
+    if (!result.richBlack)
+    {
+        result.fullInkRows.clear();
+    }
+
+    std::lock_guard<std::mutex> lock(m_cacheMutex);
+    m_detectedImages.emplace(&*image, std::move(result));
+}
+
+// Look for the result of the detection pass from detectImageAhead(), copying out the rows with full K if asked
+bool CCmykBlackConverterImplementation::findDetectedImage(const IDOMImagePtr& image, bool& richBlack, std::vector<uint64>* fullInkRows) const
+{
+    std::lock_guard<std::mutex> lock(m_cacheMutex);
+    const auto found = m_detectedImages.find(&*image);
+    if (found == m_detectedImages.end())
+    {
+        return false;
+    }
+
+    richBlack = found->second.richBlack;
+    if (fullInkRows)
+    {
+        *fullInkRows = found->second.fullInkRows;
+    }
+    m_imagesDetectedAhead++;
+    return true;
+}
+
+// The image index key: a hash of the encoded image data together with everything that decides the pixels it decodes
+// to. The same data decodes differently under another filter, DecodeParms, Decode (such as the inverted Decode of
+// many Adobe CMYK JPEGs) or color space, so for a PDF image these come from its dictionary. A JPEG image carries
+// all of this in its own data. Returns false if the image data is not available, or the image is of another kind
+// (a filtered image, say), whose decoding is not known.
+bool CCmykBlackConverterImplementation::getImageKey(const IDOMImagePtr& image, const IImageFramePtr& frame, uint8 numChannels,
+                                                    CImageIndex::CKey& key) const
+{
+    CContentHash hash;
+    const IDOMColorSpacePtr colorSpace = frame->getColorSpace();
+    const uint32 layout[6] = { frame->getWidth(), frame->getHeight(), frame->getBPS(), numChannels,
+                               (uint32) colorSpace->getColorSpaceType(), (uint32) frame->getExtraChannelType() };
+    hash.update(layout, sizeof(layout));
+
+    IDOMPDFImagePtr pdfImage = edlobj2IDOMPDFImage(image);
+    if (pdfImage)
+    {
+        const uint32 decodeType = (uint32) pdfImage->getDecodeType();
+        hash.update("pdf", 3);
+        hash.update(&decodeType, sizeof(decodeType));
+
+        const CFloatVect decode = pdfImage->getDecode();
+        const uint32 decodeSize = (uint32) decode.size();
+        hash.update(&decodeSize, sizeof(decodeSize));
+        if (decodeSize)
+        {
+            hash.update(&decode[0], decodeSize * sizeof(float));
+        }
+
+        const U8String decodeParms = pdfImage->getDecodeParms();
+        const uint32 decodeParmsSize = (uint32) decodeParms.size();
+        hash.update(&decodeParmsSize, sizeof(decodeParmsSize));
+        hash.update(decodeParms);
+    }
+    else if (edlobj2IDOMJPEGImage(image))
+    {
+        hash.update("jpeg", 4);
+    }
+    else
+    {
+        return false;
+    }
+
+    IInputStreamPtr stream = image->getStream();
+    if (!stream || !stream->open())
+    {
+        return false;
+    }
+
+    // Hashing the encoded data is far cheaper than decoding it
+    const int32 bufferBytes = 64 * 1024;
+    uint8* buffer = reserveScratch(scratch.streamBuffer, bufferBytes);
+    int32 length;
+    while ((length = stream->read(buffer, bufferBytes)) > 0)
+    {
+        hash.update(buffer, (size_t) length);
+    }
+    stream->close();
+
+    hash.final(key);
+    return true;
+}
+
+// Will a converted image be DCT encoded? Only continuous tone CMYK results are candidates for DCT; DeviceN
+// results are masks, which DCT would blur.
+bool CCmykBlackConverterImplementation::outputIsDct(const IDOMImagePtr& sourceImage, uint8 bps, eImageExtraChannelType extraChannelType) const
+{
+    const bool continuousTone = !m_useDeviceN && bps == 8 && extraChannelType == eIECNone;
+    const bool sourceIsDct = edlobj2IDOMJPEGImage(sourceImage) != nullptr;
+
+    return continuousTone && (m_imageEncoding == eIEDCT || (m_imageEncoding == eIEAuto && sourceIsDct));
+}
+
+// Create the image (and its writer) for a converted image, choosing the encoding
+IDOMImagePtr CCmykBlackConverterImplementation::createOutputImage(const IDOMImagePtr& sourceImage, IImageFrameWriterPtr& frameWriter,
+                                                                  uint32 width, uint32 height, uint8 bps, double xRes, double yRes,
+                                                                  eImageExtraChannelType extraChannelType) const
+{
+    if (outputIsDct(sourceImage, bps, extraChannelType))
+    {
+        uint8 quality = m_jpegQuality;
+        if (!quality)
+        {
+            quality = getSourceJpegQuality(sourceImage);
+        }
+        if (!quality)
+        {
+            quality = defaultJpegQuality;
+        }
+        return IDOMJPEGImage::createWriterAndImage(m_jawsMako, frameWriter, m_flatBlackColorSpace, width, height, bps, xRes, yRes, quality);
+    }
+
+    return IDOMRawImage::createWriterAndImage(m_jawsMako, frameWriter, m_flatBlackColorSpace, width, height, bps, xRes, yRes, extraChannelType);
+}
+
+// Estimate the quality a DCT source image was encoded at, from its quantization tables. Returns 0 if unknown.
+uint8 CCmykBlackConverterImplementation::getSourceJpegQuality(const IDOMImagePtr& image) const
+{
+    if (!edlobj2IDOMJPEGImage(image))
+    {
+        return 0;
+    }
+
+    IInputStreamPtr stream = image->getStream();
+    if (!stream || !stream->open())
+    {
+        return 0;
+    }
+
+    const uint8 quality = estimateJpegQuality(stream);
+    stream->close();
+    return quality;
+}
+
+// Get an image frame, applying a BitScaler filter if required.
+IDOMImagePtr CCmykBlackConverterImplementation::getFilteredImage(const IDOMImagePtr &inImage, uint8 bps) const
+{
+    IDOMImagePtr image = inImage;
+
+    switch (bps)
+    {
+        case 1:
+        case 2:
+        case 4:
+            bps = 8;
+            break;
+
+        case 12:
+            bps = 16;
+            break;
+
+        case 8:
+        case 16:
+            return image;
+
+        default:
+            throwEDLError(JM_ERR_GENERAL, L"Unsupported BPS");
+    }
+
+    IDOMImageBitScalerFilterPtr scaler = IDOMImageBitScalerFilter::create(m_jawsMako, bps);
+    return IDOMFilteredImage::create(m_jawsMako, image, scaler);
+}
+
+IDOMImagePtr CCmykBlackConverterImplementation::transformImage(const IDOMImagePtr &inImage) const
+{
+    IDOMImagePtr image = inImage;
+
+    // Indexed images are handled by changing the palette
+    IDOMColorSpaceIndexedPtr indexed = edlobj2IDOMColorSpaceIndexed(image->getImageFrame(m_jawsMako)->getColorSpace());
+    if (indexed)
+    {
+        return transformIndexedImage(image, indexed);
+    }
+
+    IImageFramePtr frame;
+    uint8 numChannels = 0;
+    IDOMImagePtr filteredImage = getCmykFrame(image, frame, numChannels);
+    if (!filteredImage)
+    {
+        return image;
+    }
+
+    // Get the new BPS.
+    uint8 bps = frame->getBPS();
+
+    uint32 width = frame->getWidth();
+    uint32 height = frame->getHeight();
+    eImageExtraChannelType extraChannelType = frame->getExtraChannelType();
+
+    const size_t rowBytes = frame->getRawBytesPerRow();
+
+    // First see if we need to convert, noting which rows the conversion needs to look at. For an image the
+    // index knows about that is already known, and a clean image need not be decoded at all.
+    // The look-ahead detector may have done this already.
+    std::vector<uint64>& fullInkRows = scratch.fullInkRows;
+    bool richBlack;
+    if (!findDetectedImage(inImage, richBlack, &fullInkRows))
+    {
+        CImageIndex::CKey imageKey;
+        const bool haveKey = m_imageIndex && getImageKey(inImage, frame, numChannels, imageKey);
+        const CImageIndex::eImageState state = haveKey ? m_imageIndex->lookup(imageKey, &fullInkRows) : CImageIndex::eISUnknown;
+
+        if (state != CImageIndex::eISUnknown)
+        {
+            m_imagesFromIndex++;
+            richBlack = state == CImageIndex::eISRichBlack;
+        }
+        else
         {
-            for (uint32 y = 0; y < height; y++)
+            richBlack = scanForRichBlack(frame, bps, numChannels, rowBytes, &fullInkRows);
+            if (haveKey)
             {
-                frame->readScanLine(&scanline[0], scanline.size());
+                m_imageIndex->store(imageKey, richBlack, height, &fullInkRows);
+            }
+        }
+    }
 
-                uint16* ptr = (uint16*)&scanline[0];
+    if (!richBlack)
+    {
+        // Nothing to do.
+        return image;
+    }
 
-                for (uint32 x = 0; x < scanline.size() / 2; x += numChannels)
+    // We need to convert, Get the frame again.
+    frame = filteredImage->getImageFrame(m_jawsMako);
+
+    // In DeviceN mode every output sample is either no ink or full ink. Without an extra channel to carry
+    // along, the result is therefore written as a 1 bps image.
+    const bool binaryOutput = m_useDeviceN && extraChannelType == eIECNone;
+    const uint8 outBps = binaryOutput ? 1 : bps;
+
+    size_t outRowBytes = rowBytes;
+    if (binaryOutput)
+    {
+        outRowBytes = (width + 7) / 8;
+    }
+    else if (m_useDeviceN)
+    {
+        outRowBytes = (size_t) width * 2 * (bps / 8);
+    }
+
+    // Above the image memory budget the converted data goes to a temporary file rather than an in-memory image.
+    // DCT output is compressed already, and the spill file has no way to carry an extra channel.
+    std::unique_ptr<CImageSpillFile> spill;
+    if (m_maxImageMemory && (uint64) outRowBytes * height > m_maxImageMemory && extraChannelType == eIECNone
+        && !outputIsDct(inImage, outBps, extraChannelType))
+    {
+        spill.reset(new CImageSpillFile(outRowBytes));
+    }
+
+    // Create a writer and image. Large images are compressed on a worker thread while we convert.
+    IImageFrameWriterPtr frameWriter;
+    if (!spill)
+    {
+        image = createOutputImage(inImage, frameWriter, width, height, outBps,
+                                  frame->getXResolution(), frame->getYResolution(), extraChannelType);
+    }
+
+    uint32 queueDepth = 0;
+    if (!spill && outRowBytes * height >= asyncEncodeThreshold)
+    {
+        queueDepth = (uint32) std::max<size_t>(1, std::min<size_t>(height, asyncEncodeQueueBytes / outRowBytes));
+    }
+    CAsyncFrameWriter writer(frameWriter, outRowBytes, queueDepth, scratch.encodeQueue);
+
+    // Rows without full K are unchanged in CMYK, and have no ink in a DeviceN mask. DeviceN rows with an extra
+    // channel always go through the kernel, which carries the extra channel across.
+    uint8* zeroScanline = nullptr;
+    if (binaryOutput)
+    {
+        zeroScanline = reserveScratch(scratch.zeroScanline, outRowBytes);
+        memset(zeroScanline, 0, outRowBytes);
+    }
+
+    // Convert rich black to flat black, a block of rows at a time. For large images this is the middle of a three
+    // stage pipeline: blocks are decoded ahead on one worker thread and compressed behind on another. Converted rows go to the matching row of the
+    // output block; unchanged rows are written straight from the source block. As in the detection pass, a row
+    // identical to the one before is written again without converting it. The input is never modified.
+    const uint32 queueBlocks = rowBytes * height >= asyncDecodeThreshold ? asyncDecodeBlocks : 0;
+    CScanlineBlockReader reader(frame, rowBytes, height, scanlineBlockBytes, queueBlocks, scratch.sourceBlock);
+    uint8* outBlock = reserveScratch(scratch.outBlock, outRowBytes * reader.maxRows());
+    std::vector<const uint8*>& outRows = scratch.outRows;
+    outRows.resize(reader.maxRows());
+    const uint8* lastOutput = nullptr;
+    bool lastConverted = false;
+
+    // Convert rows first to last - 1 of the block. A band other than the first starts with no output, so its
+    // first row is never taken as a repeat, as the band before may not have produced its output yet.
+    auto convertRows = [&](uint32 first, uint32 last, const uint8*& bandOutput, bool& bandConverted)
+    {
+        for (uint32 i = first; i < last; i++)
+        {
+            const uint32 y = reader.blockStart() + i;
+            const uint8* row = reader.row(i);
+            uint8* outRow = outBlock + i * outRowBytes;
+
+            if (y > 0 && (i == 0 || bandOutput) && memcmp(row, reader.row(i - 1), rowBytes) == 0)
+            {
+                // Same output as the last row. At the start of a block that was written from the previous
+                // block's buffers, which are being reused, so point at (or copy) it afresh.
+                if (i == 0 && bandOutput != zeroScanline)
                 {
-                    if (ptr[x + 3] == 0xffff)
+                    if (bandConverted && bandOutput != outRow)
                     {
-                        ptr[x] = ptr[x + 1] = ptr[x + 2] = 0;
+                        memcpy(outRow, bandOutput, outRowBytes);
                     }
+                    bandOutput = bandConverted ? outRow : row;
                 }
-                frameWriter->writeScanLine(&scanline[0]);
             }
+            else if (rowIsSet(fullInkRows, y) || (m_useDeviceN && !binaryOutput))
+            {
+                convertScanLine(row, outRow, rowBytes, width, bps, numChannels, binaryOutput);
+                bandOutput = outRow;
+                bandConverted = true;
+            }
+            else
+            {
+                bandOutput = binaryOutput ? zeroScanline : row;
+                bandConverted = false;
+            }
+            outRows[i] = bandOutput;
+        }
+    };
+
+    const uint32 bandRows = (uint32) std::max<size_t>(1, minBandBytes / rowBytes);
+    for (uint32 numRows; (numRows = reader.readBlock()) != 0;)
+    {
+        const uint32 numBands = m_taskPool ? std::min(m_taskPool->numThreads(), numRows / bandRows) : 1;
+        if (numBands <= 1)
+        {
+            convertRows(0, numRows, lastOutput, lastConverted);
         }
         else
         {
-            for (uint32 y = 0; y < height; y++)
+            // The bands after the first go to the pool, and this thread takes the first. The first row may
+            // be copied from a row of the previous block, so it is done before any band overwrites that. The
+            // last band's final row carries over to the next block.
+            convertRows(0, 1, lastOutput, lastConverted);
+            CTaskGroup bands;
+            std::vector<std::pair<const uint8*, bool>> bandLast(numBands);
+            for (uint32 band = 1; band < numBands; band++)
             {
-                frame->readScanLine(&scanline[0], scanline.size());
-
-                for (uint32 x = 0; x < scanline.size(); x += numChannels)
+                m_taskPool->submit(bands, [&, band]
                 {
-                    if (scanline[x + 3] == 0xff)
-                    {
-                        scanline[x] = scanline[x + 1] = scanline[x + 2] = 0;
-                    }
-                }
-                frameWriter->writeScanLine(&scanline[0]);
+                    convertRows(numRows * band / numBands, numRows * (band + 1) / numBands, bandLast[band].first, bandLast[band].second);
+                });
             }
+            convertRows(1, numRows / numBands, lastOutput, lastConverted);
+            m_taskPool->wait(bands);
+            lastOutput = bandLast[numBands - 1].first;
+            lastConverted = bandLast[numBands - 1].second;
+        }
+
+        if (spill)
+        {
+            spill->writeScanLines(outRows.data(), numRows);
         }
+        else
+        {
+            writer.writeScanLines(outRows.data(), numRows);
+        }
+    }
+
+    if (spill)
+    {
+        // The image reads its data back from the file, run length encoded
+        return IDOMPDFImage::create(m_jawsMako, spill->finish(), IDOMPDFImage::eDTRunLength, m_flatBlackColorSpace, width, height, outBps);
     }
 
-    frameWriter->flushData();
+    writer.flushData();
 
     return image;
 }
 
+// Convert one row of CMYK data to the output format
+void CCmykBlackConverterImplementation::convertScanLine(const uint8* scanline, uint8* outScanline, size_t rowBytes, uint32 width, uint8 bps,
+                                                        uint8 numChannels, bool binaryOutput) const
+{
+    if (binaryOutput)
+    {
+        if (bps != 8)
+        {
+            convertRowToMask((const uint16*) scanline, outScanline, width, numChannels);
+        }
+        else
+        {
+            convertRowToMask(scanline, outScanline, width, numChannels);
+        }
+    }
+    else if (m_useDeviceN)
+    {
+        if (bps != 8)
+        {
+            convertRowToDeviceN((const uint16*) scanline, (uint16*) outScanline, width, numChannels);
+        }
+        else
+        {
+            convertRowToDeviceN(scanline, outScanline, width, numChannels);
+        }
+    }
+    else
+    {
+        memcpy(outScanline, scanline, rowBytes);
+        if (bps != 8)
+        {
+            convertRowToFlatBlack((uint16*) outScanline, width, numChannels);
+        }
+        else
+        {
+            convertRowToFlatBlack(outScanline, width, numChannels);
+        }
+    }
+}
+
+// For an indexed image with a CMYK base, rich black can only come from the palette. So convert the palette
+// entries and give the index data the new color space; the index data itself is left untouched. In DeviceN
+// mode the base space remains CMYK, so the palette entries become CMYK flat black.
+// A PDF image's encoded data is passed through as it is, so the output copies it without decoding it. Other
+// images, and encodings the new image can't carry (Decode arrays and DecodeParms), fall back to a filtered
+// image, which the PDF output decodes and compresses again when it is written.
+IDOMImagePtr CCmykBlackConverterImplementation::transformIndexedImage(const IDOMImagePtr &inImage, const IDOMColorSpaceIndexedPtr& indexed) const
+{
+    IDOMColorSpacePtr base = indexed->getBaseColorSpace();
+    if (!edlobj2IDOMColorSpaceDeviceCMYK(base))
+    {
+        return inImage;
+    }
+
+    CEDLSimpleBuffer lookup = indexed->getLookup();
+    if (!transformLookup(lookup, indexed->getHiVal() + 1))
+    {
+        // Nothing to do.
+        return inImage;
+    }
+
+    IDOMColorSpaceIndexedPtr newIndexed = IDOMColorSpaceIndexed::create(m_jawsMako, base, indexed->getHiVal(), lookup);
+
+    IDOMImagePtr encoded = reuseEncodedImage(inImage, newIndexed);
+    if (encoded)
+    {
+        return encoded;
+    }
+
+    IDOMImageColorSpaceSubstitutionFilterPtr substitution = IDOMImageColorSpaceSubstitutionFilter::create(m_jawsMako, newIndexed);
+    return IDOMFilteredImage::create(m_jawsMako, inImage, substitution);
+}
+
+// Give a PDF image's encoded data a new color space, without decoding it. The encoded data is read into
+// memory as it is, which for index data is small. Returns null if the image can't be carried over like this.
+IDOMImagePtr CCmykBlackConverterImplementation::reuseEncodedImage(const IDOMImagePtr& image, const IDOMColorSpacePtr& colorSpace) const
+{
+    IDOMPDFImagePtr pdfImage = edlobj2IDOMPDFImage(image);
+    if (!pdfImage || !pdfImage->getDecode().empty() || !pdfImage->getDecodeParms().empty())
+    {
+        return IDOMImagePtr();
+    }
+
+    const IDOMPDFImage::eDecodeType decodeType = pdfImage->getDecodeType();
+    if (decodeType != IDOMPDFImage::eDTNone && decodeType != IDOMPDFImage::eDTFlate && decodeType != IDOMPDFImage::eDTRunLength)
+    {
+        return IDOMImagePtr();
+    }
+
+    IInputStreamPtr stream = image->getStream();
+    if (!stream || !stream->open())
+    {
+        return IDOMImagePtr();
+    }
+
+    IRAInputStreamPtr data;
+    try
+    {
+        data = createReadInputStream([&stream](void* buffer, size_t length) -> int64
+        {
+            return stream->read(buffer, static_cast<int32>(std::min<size_t>(length, std::numeric_limits<int32>::max())));
+        });
+    }
+    catch (...)
+    {
+    }
+    stream->close();
+    if (!data)
+    {
+        return IDOMImagePtr();
+    }
+
+    const IImageFramePtr frame = image->getImageFrame(m_jawsMako);
+    return IDOMPDFImage::create(m_jawsMako, data, decodeType, colorSpace, frame->getWidth(), frame->getHeight(), frame->getBPS());
+}
+
+// Convert any rich black entries in an 8 bit CMYK lookup table. Returns true if any were changed.
+bool CCmykBlackConverterImplementation::transformLookup(CEDLSimpleBuffer& lookup, uint32 numEntries) const
+{
+    bool changed = false;
+
+    for (uint32 entry = 0; entry < numEntries && (entry + 1) * 4 <= lookup.size(); entry++)
+    {
+        uint8* cmyk = &lookup[entry * 4];
+        if (cmyk[3] == 0xff && (cmyk[0] != 0 || cmyk[1] != 0 || cmyk[2] != 0))
+        {
+            cmyk[0] = cmyk[1] = cmyk[2] = 0;
+            changed = true;
+        }
+    }
+
+    return changed;
+}
+
 IDOMColorPtr CCmykBlackConverterImplementation::transformColor(const IDOMColorPtr& inColor) const
 {
     IDOMColorPtr outColor = inColor;
@@ -12,30 +12,126 @@
 
 #pragma once
 
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
 #include <jawsmako/jawsmako.h>
 #include <jawsmako/customtransform.h>
 
+#include "ImageEncoding.h"
+#include "ImageIndex.h"
+#include "TaskScheduler.h"
+
 #define OVERPRINT_MODE     1
 #define OVERPRINT_FILL     2
 #define OVERPRINT_STROKE   4
 
+// The version of the conversion. Bump it whenever a change to this tool changes the output it writes for any
+// input, so that results cached by earlier versions are no longer used.
+#define CMYK_BLACK_CONVERTER_OUTPUT_VERSION     1
+
 using namespace JawsMako;
 
+// Counts of the work done by the transform, for performance tuning
+struct CTransformStats
+{
+    uint64 nodesVisited = 0;            // Glyphs, path and charpath group nodes
+    uint64 genericDescents = 0;         // Times the generic implementation was asked to descend into a node
+    uint64 genericDescentsSkipped = 0;  // Times that was skipped as the node only had leaf brushes
+    uint64 imagesFromIndex = 0;         // Images whose detection pass was skipped thanks to the image index
+    uint64 imagesDetectedAhead = 0;     // Images whose detection pass was done ahead by detectImageAhead()
+};
+
+// Converter configuration. This is fixed when the converter is created.
+struct CCmykBlackConverterOptions
+{
+    bool useDeviceN = false;                // Use a DeviceN (spot) black instead of a DeviceCMYK black
+    bool doNotApplyOverprint = false;       // Do not set overprint on changed objects
+    bool analyzeOnly = false;               // Record rich black objects instead of changing them
+    eImageEncoding imageEncoding = eIEAuto;
+    uint8 jpegQuality = 0;                  // 0 to match the source
+    uint64 maxImageMemory = 0;              // Converted images larger than this (in bytes) go to a temporary file; 0 for no limit
+    std::string imageIndex;                 // Path of a persistent image index to use; empty for none
+    CWorkStealingPool* taskPool = nullptr;  // Converts large images in bands on this pool; null to convert on the calling thread
+};
+
+// An object found to use rich black when running in analysis-only mode
+struct CRichBlackObject
+{
+    enum eObjectType
+    {
+        eFill,
+        eStroke,
+        eGlyphs,
+        ePatternColor,
+        eImage
+    };
+
+    eObjectType type;
+    FRect bounds;       // In page space
+};
+typedef std::vector<CRichBlackObject> CRichBlackObjectVect;
+
+// A single instance may be shared by several threads, each transforming its own pages. The configuration and
+// the flat black objects are fixed at construction, and image conversion uses per-thread scratch buffers.
 class CCmykBlackConverterImplementation : public ICustomTransform::IImplementation
 {
 public:
-    CCmykBlackConverterImplementation(const IJawsMakoPtr& jawsMako, bool useDeviceN, bool doNotApplyOverprint);
+    CCmykBlackConverterImplementation(const IJawsMakoPtr& jawsMako, const CCmykBlackConverterOptions& options);
     IDOMNodePtr transformGlyphs(IImplementation* genericImplementation, const IDOMGlyphsPtr& glyphs, bool& changed, const CTransformState& state) override;
     IDOMNodePtr transformPath(IImplementation* genericImplementation, const IDOMPathNodePtr& path, bool& changed, const CTransformState& state) override;
     IDOMNodePtr transformCharPathGroup(IImplementation* genericImplementation, const IDOMCharPathGroupPtr& group,
                                        bool& changed, bool transformChildren, const CTransformState& state) override;
+    IDOMBrushPtr transformBrush(IImplementation* genericImplementation, const IDOMBrushPtr& brush, eBrushUsage usage, const CTransformState& state) override;
 
+    // Release the cached tiling pattern results, and with them the references to the document's patterns,
+    // along with the interned flat black brushes. Call when finished with a document.
+    void clearCaches() const;
+
+    // Run the detection pass on a CMYK image ahead of its transform, perhaps on another thread, keeping the result
+    // until clearCaches(). It must not run on a page that is being transformed.
+    void detectImageAhead(const IDOMImagePtr& image) const;
+
+    // Work done since the converter was created, across all threads
+    CTransformStats getStats() const;
+
+    // In analysis-only mode, the rich black objects found by the calling thread since its last call to clearAnalysis()
+    const CRichBlackObjectVect& getAnalysis() const;
+    void clearAnalysis() const;
 
 private:
     bool colorIsCmykRichBlack(const IDOMColorPtr& color) const;
+    bool brushHasRichBlack(const IDOMBrushPtr& brush, CRichBlackObject::eObjectType solidType, CRichBlackObject::eObjectType& foundType) const;
+    bool imageHasRichBlack(const IDOMImagePtr& image) const;
+    bool scanForRichBlack(const IImageFramePtr& frame, uint8 bps, uint8 numChannels, size_t rowBytes,
+                          std::vector<uint64>* fullInkRows = nullptr) const;
+    void recordRichBlack(const IDOMNodePtr& node, const IDOMBrushPtr& brush, CRichBlackObject::eObjectType solidType,
+                         const CTransformState& state) const;
     IDOMColorPtr transformColor(const IDOMColorPtr& inColor) const;     // NOLINT(clang-diagnostic-overloaded-virtual)
     IDOMBrushPtr transformBrush(const IDOMBrushPtr& inBrush) const;     // NOLINT(clang-diagnostic-overloaded-virtual)
     IDOMImagePtr transformImage(const IDOMImagePtr &inImage) const;
+    template <class T>
+    IDOMBrushPtr transformGradient(const T& gradient) const;
+    bool transformGradientStops(const IDOMGradientStopCollectionPtr& stops, IDOMGradientStopCollectionPtr* newStops) const;
+    bool transformShading(const IDOMShadingPtr& shading, IDOMShadingPtr* newShading) const;
+    bool transformFunction(const IDOMFunctionPtr& function, IDOMFunctionPtr* newFunction) const;
+    IDOMImagePtr getCmykFrame(const IDOMImagePtr& image, IImageFramePtr& frame, uint8& numChannels) const;
+    void convertScanLine(const uint8* scanline, uint8* outScanline, size_t rowBytes, uint32 width, uint8 bps,
+                         uint8 numChannels, bool binaryOutput) const;
+    IDOMImagePtr transformIndexedImage(const IDOMImagePtr &inImage, const IDOMColorSpaceIndexedPtr& indexed) const;
+    IDOMImagePtr reuseEncodedImage(const IDOMImagePtr& image, const IDOMColorSpacePtr& colorSpace) const;
+    bool transformLookup(CEDLSimpleBuffer& lookup, uint32 numEntries) const;
+    bool outputIsDct(const IDOMImagePtr& sourceImage, uint8 bps, eImageExtraChannelType extraChannelType) const;
+    IDOMImagePtr createOutputImage(const IDOMImagePtr& sourceImage, IImageFrameWriterPtr& frameWriter, uint32 width, uint32 height,
+                                   uint8 bps, double xRes, double yRes, eImageExtraChannelType extraChannelType) const;
+    uint8 getSourceJpegQuality(const IDOMImagePtr& image) const;
+    bool getImageKey(const IDOMImagePtr& image, const IImageFramePtr& frame, uint8 numChannels, CImageIndex::CKey& key) const;
+    bool findDetectedImage(const IDOMImagePtr& image, bool& richBlack, std::vector<uint64>* fullInkRows) const;
     IDOMImagePtr getFilteredImage(const IDOMImagePtr &image, uint8 bps) const;
     IDOMColorSpaceDeviceNPtr makeNewDeviceNColorSpace(
         const EDLSysString& spotColorName, const std::vector<float>& cmykValues) const;
@@ -43,14 +139,57 @@ private:
 
 
     template <class T>
-    bool transformStroke(const T& node);
+    bool transformStroke(const T& node) const;
 
 	template <class T>
-    bool transformFill(const T& node);
+    bool transformFill(const T& node) const;
+
+    const IJawsMakoPtr m_jawsMako;
+    const bool m_useDeviceN;
+    const bool m_doNotApplyOverprint;
+    const bool m_analyzeOnly;
+    const eImageEncoding m_imageEncoding;
+    const uint8 m_jpegQuality;      // 0 to match the source
+    const uint64 m_maxImageMemory;  // 0 for no limit
+    CWorkStealingPool* const m_taskPool;
 
-    IJawsMakoPtr m_jawsMako;
-    bool m_useDeviceN;
-    bool m_doNotApplyOverprint;
+    // Set up by the constructor and not changed after
     IDOMColorSpacePtr m_flatBlackColorSpace;
     IDOMColorPtr m_flatBlack;
+
+    // Tiling pattern results, by the identity of the source brush, so that a pattern used many times is
+    // transformed once and the output shares one pattern. The source brush is held so it can't be reused.
+    typedef std::map<const IDOMBrush*, std::pair<IDOMBrushPtr, IDOMBrushPtr>> CBrushCache;
+    bool findCachedBrush(const CBrushCache& cache, const IDOMBrushPtr& source, IDOMBrushPtr& result) const;
+    IDOMBrushPtr cacheBrush(CBrushCache& cache, const IDOMBrushPtr& source, const IDOMBrushPtr& result) const;
+
+    mutable std::atomic<uint64> m_nodesVisited;
+    mutable std::atomic<uint64> m_genericDescents;
+    mutable std::atomic<uint64> m_genericDescentsSkipped;
+    mutable std::atomic<uint64> m_imagesFromIndex;
+    mutable std::atomic<uint64> m_imagesDetectedAhead;
+
+    std::unique_ptr<CImageIndex> m_imageIndex;  // Shared between threads; it does its own locking
+
+    mutable std::mutex m_cacheMutex;
+    mutable CBrushCache m_patternColorCache;    // Pattern color changes (PaintType 2)
+    mutable CBrushCache m_patternCellCache;     // Descent into the pattern cell
+
+    // Detection results from detectImageAhead(), by the identity of the image, which is held so it can't be reused
+    struct CDetectedImage
+    {
+        IDOMImagePtr image;
+        bool richBlack;
+        std::vector<uint64> fullInkRows;
+    };
+    mutable std::map<const IDOMImage*, CDetectedImage> m_detectedImages;
+
+    // Converted brushes and colors are interned, so that equivalent results are one object in the output.
+    // Converted solid brushes always carry m_flatBlack, so they only differ by opacity. All flat black
+    // results use the one m_flatBlackColorSpace.
+    IDOMBrushPtr internFlatBlackBrush(const IDOMSolidColorBrushPtr& source) const;
+    IDOMColorPtr internFlatBlackCmyk(float alpha) const;
+
+    mutable std::map<double, IDOMBrushPtr> m_flatBlackBrushes;     // By opacity
+    mutable std::map<float, IDOMColorPtr> m_flatBlackCmykColors;   // By alpha
 };
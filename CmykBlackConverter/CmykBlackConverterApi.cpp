@@ -0,0 +1,312 @@
+/* -----------------------------------------------------------------------
+ *  <copyright file="CmykBlackConverterApi.cpp" company="Global Graphics Software Ltd">
+ *      Copyright (c) 2023 Global Graphics Software Ltd. All rights reserved.
+ *  </copyright>
+ *  <summary>
+ *  This example is provided on an "as is" basis and without warranty of any kind.
+ *  Global Graphics Software Ltd. does not warrant or make any representations regarding the use or
+ *  results of use of this example.
+ *  </summary>
+ * -----------------------------------------------------------------------
+ */
+
+#include "CmykBlackConverterApi.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <string>
+
+#include <jawsmako/jawsmako.h>
+
+#include "BatchConverter.h"
+#include "CmykBlackConverter.h"
+#include "MemoryStreams.h"
+
+using namespace JawsMako;
+using namespace EDL;
+
+// The sizes of the structures in the first version of this interface. Callers built against a version with
+// fewer fields pass a smaller size; only the fields they have are read, and the rest take their defaults.
+static const size_t optionsV1Size = offsetof(cbc_options, image_index) + sizeof(const char*);
+static const size_t inputV1Size = offsetof(cbc_input, name) + sizeof(const char*);
+static const size_t outputV1Size = offsetof(cbc_output, size) + sizeof(size_t);
+
+// Copy the fields a caller's structure has over the defaults in result
+template <typename T>
+static void copyGivenFields(T& result, const T& given)
+{
+    memcpy(&result, &given, std::min<size_t>(given.struct_size, sizeof(T)));
+}
+
+struct cbc_converter
+{
+    IJawsMakoPtr jawsMako;
+    CCmykBlackConverterOptions options;
+    std::unique_ptr<CBatchConverter> batch;     // Its pool of threads is kept from one call to the next
+    std::string lastError;
+};
+
+// Growing memory for a result, handed over to the caller as it is
+struct CResultBuffer
+{
+    uint8* data = nullptr;
+    size_t size = 0;
+    size_t capacity = 0;
+
+    ~CResultBuffer()
+    {
+        free(data);
+    }
+
+    bool append(const void* bytes, size_t length)
+    {
+        if (size + length > capacity)
+        {
+            const size_t newCapacity = std::max(size + length, std::max<size_t>(capacity * 2, 1024 * 1024));
+            uint8* newData = (uint8*) realloc(data, newCapacity);
+            if (!newData)
+            {
+                return false;
+            }
+            data = newData;
+            capacity = newCapacity;
+        }
+        memcpy(data + size, bytes, length);
+        size += length;
+        return true;
+    }
+};
+
+static std::string toUtf8(const std::wstring& text)
+{
+    std::string utf8;
+    for (size_t i = 0; i < text.size(); i++)
+    {
+        uint32_t c = (uint32_t) text[i];
+
+        // Windows wide strings are UTF-16
+        if (c >= 0xD800 && c < 0xDC00 && i + 1 < text.size() && (uint32_t) text[i + 1] >= 0xDC00 && (uint32_t) text[i + 1] < 0xE000)
+        {
+            c = 0x10000 + ((c - 0xD800) << 10) + ((uint32_t) text[++i] - 0xDC00);
+        }
+
+        if (c < 0x80)
+        {
+            utf8 += (char) c;
+        }
+        else if (c < 0x800)
+        {
+            utf8 += (char) (0xC0 | (c >> 6));
+            utf8 += (char) (0x80 | (c & 0x3F));
+        }
+        else if (c < 0x10000)
+        {
+            utf8 += (char) (0xE0 | (c >> 12));
+            utf8 += (char) (0x80 | ((c >> 6) & 0x3F));
+            utf8 += (char) (0x80 | (c & 0x3F));
+        }
+        else
+        {
+            utf8 += (char) (0xF0 | (c >> 18));
+            utf8 += (char) (0x80 | ((c >> 12) & 0x3F));
+            utf8 += (char) (0x80 | ((c >> 6) & 0x3F));
+            utf8 += (char) (0x80 | (c & 0x3F));
+        }
+    }
+    return utf8;
+}
+
+uint32_t cbc_api_version(void)
+{
+    return CBC_API_VERSION;
+}
+
+void cbc_default_options(cbc_options* options, uint32_t struct_size)
+{
+    if (!options || struct_size < optionsV1Size)
+    {
+        return;
+    }
+
+    // A caller built against a later version may have fields this one doesn't know; they are left alone
+    cbc_options defaults;
+    memset(&defaults, 0, sizeof(cbc_options));
+    defaults.struct_size = std::min<uint32_t>(struct_size, sizeof(cbc_options));
+    defaults.image_encoding = CBC_IMAGE_ENCODING_AUTO;
+    memcpy(options, &defaults, defaults.struct_size);
+}
+
+int32_t cbc_create(const cbc_options* options, cbc_converter** converter)
+{
+    if (!converter)
+    {
+        return CBC_ERROR_ARGUMENT;
+    }
+    *converter = nullptr;
+
+    cbc_options given;
+    cbc_default_options(&given, sizeof(cbc_options));
+    if (options)
+    {
+        if (options->struct_size < optionsV1Size)
+        {
+            return CBC_ERROR_ARGUMENT;
+        }
+        copyGivenFields(given, *options);
+    }
+    if (given.image_encoding < CBC_IMAGE_ENCODING_AUTO || given.image_encoding > CBC_IMAGE_ENCODING_DCT
+        || given.jpeg_quality < 0 || given.jpeg_quality > 100)
+    {
+        return CBC_ERROR_ARGUMENT;
+    }
+
+    try
+    {
+        cbc_converter* created = new cbc_converter();
+        created->options.useDeviceN = given.use_devicen != 0;
+        created->options.doNotApplyOverprint = given.no_overprint != 0;
+        created->options.analyzeOnly = given.analyze_only != 0;
+        created->options.imageEncoding = given.image_encoding == CBC_IMAGE_ENCODING_RAW ? eIERaw
+                                       : given.image_encoding == CBC_IMAGE_ENCODING_DCT ? eIEDCT : eIEAuto;
+        created->options.jpegQuality = static_cast<uint8>(given.jpeg_quality);
+        created->options.maxImageMemory = given.max_image_memory;
+        if (given.image_index)
+        {
+            created->options.imageIndex = given.image_index;
+        }
+
+        try
+        {
+            created->jawsMako = IJawsMako::create();
+            IJawsMako::enablePDFInput(created->jawsMako);
+            IJawsMako::enablePDFOutput(created->jawsMako);
+
+            // The page loop of the command line tool, on a pool of threads that lasts as long as the converter
+            created->batch.reset(new CBatchConverter(created->jawsMako, created->options, given.threads, 0));
+            created->batch->setReportErrors(false);
+        }
+        catch (...)
+        {
+            delete created;
+            throw;
+        }
+        *converter = created;
+        return CBC_OK;
+    }
+    catch (IError& e)
+    {
+        return static_cast<int32_t>(e.getErrorCode());
+    }
+    catch (...)
+    {
+        return CBC_ERROR_FAILED;
+    }
+}
+
+void cbc_destroy(cbc_converter* converter)
+{
+    delete converter;
+}
+
+int32_t cbc_convert(cbc_converter* converter, const cbc_input* input, cbc_output* output)
+{
+    if (!converter)
+    {
+        return CBC_ERROR_ARGUMENT;
+    }
+    converter->lastError.clear();
+
+    if (!input || !output || input->struct_size < inputV1Size || output->struct_size < outputV1Size)
+    {
+        converter->lastError = "Invalid argument";
+        return CBC_ERROR_ARGUMENT;
+    }
+
+    // Only the fields the caller's structures have are read, and only the first version's are written
+    cbc_input in;
+    memset(&in, 0, sizeof(cbc_input));
+    copyGivenFields(in, *input);
+    cbc_output out;
+    memset(&out, 0, sizeof(cbc_output));
+    copyGivenFields(out, *output);
+    if (!in.read && !in.data)
+    {
+        converter->lastError = "Invalid argument";
+        return CBC_ERROR_ARGUMENT;
+    }
+    output->data = nullptr;
+    output->size = 0;
+
+    try
+    {
+        IRAInputStreamPtr inputStream;
+        if (in.read)
+        {
+            inputStream = createReadInputStream([&in](void* buffer, size_t length)
+                {
+                    return in.read(in.context, buffer, length);
+                });
+        }
+        else
+        {
+            inputStream = createMemoryInputStream(static_cast<const uint8*>(in.data), in.size);
+        }
+
+        CResultBuffer result;
+        bool writeFailed = false;
+        const IOutputStreamPtr outputStream = createCallbackOutputStream([&](const void* data, size_t length)
+            {
+                const bool written = out.write ? out.write(out.context, data, length) == 0 : result.append(data, length);
+                writeFailed |= !written;
+                return written;
+            });
+
+        CBatchConverter& batch = *converter->batch;
+        batch.reset();
+        batch.add(in.name ? in.name : "", "", inputStream, outputStream);
+        const int exitCode = batch.finish();
+        if (exitCode)
+        {
+            converter->lastError = toUtf8(batch.getFirstError());
+            return writeFailed ? CBC_ERROR_WRITE : exitCode;
+        }
+
+        if (!out.write)
+        {
+            output->data = result.data;
+            output->size = result.size;
+            result.data = nullptr;
+        }
+        return CBC_OK;
+    }
+    catch (IError& e)
+    {
+        const String errorFormatString = getEDLErrorString(e.getErrorCode());
+        converter->lastError = toUtf8(e.getErrorDescription(errorFormatString));
+        return static_cast<int32_t>(e.getErrorCode());
+    }
+    catch (std::exception& e)
+    {
+        converter->lastError = e.what();
+        return CBC_ERROR_FAILED;
+    }
+    catch (...)
+    {
+        converter->lastError = "Unknown exception";
+        return CBC_ERROR_FAILED;
+    }
+}
+
+const char* cbc_last_error(const cbc_converter* converter)
+{
+    return converter ? converter->lastError.c_str() : "";
+}
+
+void cbc_free(void* data)
+{
+    free(data);
+}
@@ -0,0 +1,116 @@
+/* -----------------------------------------------------------------------
+ *  <copyright file="CmykBlackConverterApi.h" company="Global Graphics Software Ltd">
+ *      Copyright (c) 2023 Global Graphics Software Ltd. All rights reserved.
+ *  </copyright>
+ *  <summary>
+ *  This example is provided on an "as is" basis and without warranty of any kind.
+ *  Global Graphics Software Ltd. does not warrant or make any representations regarding the use or
+ *  results of use of this example.
+ *  </summary>
+ * -----------------------------------------------------------------------
+ */
+
+#pragma once
+
+// A C interface to the converter, for embedding it in another program as a library. Documents are converted
+// from memory or a read function to memory or a write function, without temporary files.
+//
+// The interface only grows: functions are added, never changed, and the structures carry their own size so
+// that fields can be added at the end. A structure from a caller built against an earlier version, with a
+// smaller size, is still accepted: the fields it lacks take their defaults. A converter may be used by one thread at a time; any number of
+// converters may be used at once.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(_WIN32) && defined(CBC_EXPORTS)
+#define CBC_API __declspec(dllexport)
+#elif defined(__GNUC__)
+#define CBC_API __attribute__((visibility("default")))
+#else
+#define CBC_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CBC_API_VERSION 1
+
+// Return codes. Any other value is the SDK error code, as the command line tool would exit with.
+#define CBC_OK              0
+#define CBC_ERROR_ARGUMENT  -1      // A null or inconsistent argument
+#define CBC_ERROR_WRITE     -2      // The write function failed
+#define CBC_ERROR_FAILED    1       // Failed for a reason other than an SDK error
+
+// Image encodings, as for --image-encoding
+#define CBC_IMAGE_ENCODING_AUTO 0
+#define CBC_IMAGE_ENCODING_RAW  1
+#define CBC_IMAGE_ENCODING_DCT  2
+
+typedef struct cbc_converter cbc_converter;
+
+// Reads up to length bytes into buffer, returning the number read, 0 at the end, or less than 0 on error
+typedef int64_t (*cbc_read_function)(void* context, void* buffer, size_t length);
+
+// Writes all length bytes of data, returning 0 on success
+typedef int32_t (*cbc_write_function)(void* context, const void* data, size_t length);
+
+// The options of the command line tool. Fill in with cbc_default_options() before changing any.
+typedef struct cbc_options
+{
+    uint32_t struct_size;           // sizeof(cbc_options)
+    int32_t use_devicen;            // Use a DeviceN (spot) black instead of a DeviceCMYK black
+    int32_t no_overprint;           // Do not set overprint on changed objects
+    int32_t analyze_only;           // Write the JSON rich black report instead of a document
+    int32_t image_encoding;         // CBC_IMAGE_ENCODING_...
+    int32_t jpeg_quality;           // 1-100 when DCT encoding converted images; 0 matches the source
+    uint64_t max_image_memory;      // Hold converted images larger than this many bytes in a temporary file; 0 for no limit
+    uint32_t threads;               // 0 for one per core
+    const char* image_index;        // Path of a persistent image index, in UTF-8; null for none
+} cbc_options;
+
+// The document to convert: either data and size, or a read function. A document read through a function is
+// read into memory first, since the PDF input needs to seek about it.
+typedef struct cbc_input
+{
+    uint32_t struct_size;           // sizeof(cbc_input)
+    const void* data;               // Kept in place until cbc_convert() returns
+    size_t size;
+    cbc_read_function read;         // Used when not null, instead of data
+    void* context;                  // Passed to read
+    const char* name;               // For errors and the analysis report, in UTF-8; may be null
+} cbc_input;
+
+// Where the result goes: to a write function, or, if that is null, to memory that cbc_convert() allocates and
+// the caller releases with cbc_free()
+typedef struct cbc_output
+{
+    uint32_t struct_size;           // sizeof(cbc_output)
+    cbc_write_function write;
+    void* context;                  // Passed to write
+    void* data;                     // Set by cbc_convert() when write is null
+    size_t size;
+} cbc_output;
+
+CBC_API uint32_t cbc_api_version(void);
+
+// Fill in the default options, and struct_size, for a structure of struct_size bytes: sizeof(cbc_options)
+CBC_API void cbc_default_options(cbc_options* options, uint32_t struct_size);
+
+// Create a converter with the given options, or the defaults if null. The converter starts its pool of threads
+// here, and keeps it for every document it converts until it is destroyed.
+CBC_API int32_t cbc_create(const cbc_options* options, cbc_converter** converter);
+
+CBC_API void cbc_destroy(cbc_converter* converter);
+
+CBC_API int32_t cbc_convert(cbc_converter* converter, const cbc_input* input, cbc_output* output);
+
+// The message for the last failure of a converter, in UTF-8, valid until its next call; empty if none
+CBC_API const char* cbc_last_error(const cbc_converter* converter);
+
+CBC_API void cbc_free(void* data);
+
+#ifdef __cplusplus
+}
+#endif
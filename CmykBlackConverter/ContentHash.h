@@ -0,0 +1,44 @@
+/* -----------------------------------------------------------------------
+ *  <copyright file="ContentHash.h" company="Global Graphics Software Ltd">
+ *      Copyright (c) 2023 Global Graphics Software Ltd. All rights reserved.
+ *  </copyright>
+ *  <summary>
+ *  This example is provided on an "as is" basis and without warranty of any kind.
+ *  Global Graphics Software Ltd. does not warrant or make any representations regarding the use or
+ *  results of use of this example.
+ *  </summary>
+ * -----------------------------------------------------------------------
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// SHA-256, used to name content so that results can be found again from the content alone
+class CContentHash
+{
+public:
+    enum { eDigestBytes = 32 };
+
+    CContentHash();
+
+    void update(const void* data, size_t length);
+    void update(const std::string& text) { update(text.data(), text.size()); }
+
+    // Finish the hash. The object cannot be updated afterwards.
+    void final(uint8_t digest[eDigestBytes]);
+    std::string finalHex();
+
+    // Hash a whole file. Returns false if it could not be read.
+    static bool hashFile(const std::string& path, CContentHash& hash);
+
+private:
+    void processBlock(const uint8_t* block);
+
+    uint32_t m_state[8];
+    uint64_t m_length;              // Bytes hashed so far
+    uint8_t m_block[64];
+    size_t m_blockUsed;
+};
@@ -0,0 +1,398 @@
+/* -----------------------------------------------------------------------
+ *  <copyright file="ImageEncoding.cpp" company="Global Graphics Software Ltd">
+ *      Copyright (c) 2023 Global Graphics Software Ltd. All rights reserved.
+ *  </copyright>
+ *  <summary>
+ *  This example is provided on an "as is" basis and without warranty of any kind.
+ *  Global Graphics Software Ltd. does not warrant or make any representations regarding the use or
+ *  results of use of this example.
+ *  </summary>
+ * -----------------------------------------------------------------------
+ */
+
+#include "ImageEncoding.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+// The JPEG standard (Annex K) luminance quantization table, in zig-zag order as stored in a DQT segment
+static const uint16 standardLuminanceTable[64] =
+{
+    16,  11,  12,  14,  12,  10,  16,  14,
+    13,  14,  18,  17,  16,  19,  24,  40,
+    26,  24,  22,  22,  24,  49,  35,  37,
+    29,  40,  58,  51,  61,  60,  57,  51,
+    56,  55,  64,  72,  92,  78,  64,  68,
+    87,  69,  55,  56,  80, 109,  81,  87,
+    95,  98, 103, 104, 103,  62,  77, 113,
+   121, 112, 100, 120,  92, 101, 103,  99
+};
+
+// Read exactly length bytes, as a stream may return fewer than asked for at a time
+static bool readFully(const IInputStreamPtr& stream, uint8* buffer, size_t length)
+{
+    while (length)
+    {
+        const int32 count = stream->read(buffer, (int32) length);
+        if (count <= 0)
+        {
+            return false;
+        }
+        buffer += count;
+        length -= (size_t) count;
+    }
+    return true;
+}
+
+uint8 estimateJpegQuality(const IInputStreamPtr& stream)
+{
+    // Walk the marker segments up to the first DQT (0xFFDB), skipping the others by their length. Application
+    // segments such as ICC profiles (APP2) and Photoshop resources (APP13) can run to megabytes before it.
+    uint8 bytes[4];
+    if (!readFully(stream, bytes, 2) || bytes[0] != 0xFF || bytes[1] != 0xD8)
+    {
+        return 0;
+    }
+
+    std::vector<uint8> segment;
+    for (;;)
+    {
+        if (!readFully(stream, bytes, 2) || bytes[0] != 0xFF)
+        {
+            return 0;
+        }
+        uint8 marker = bytes[1];
+        while (marker == 0xFF)
+        {
+            // Fill byte
+            if (!readFully(stream, &marker, 1))
+            {
+                return 0;
+            }
+        }
+        if (marker == 0xDA || !readFully(stream, bytes + 2, 2))
+        {
+            // Start of scan; no table found
+            return 0;
+        }
+        const size_t segmentLength = (bytes[2] << 8) | bytes[3];
+        if (segmentLength < 2)
+        {
+            return 0;
+        }
+
+        segment.resize(segmentLength - 2);
+        if (!readFully(stream, segment.data(), segment.size()))
+        {
+            return 0;
+        }
+        if (marker == 0xDB)
+        {
+            break;
+        }
+    }
+
+    // The first table in the segment. Its precision is given by the top nibble.
+    if (segment.empty())
+    {
+        return 0;
+    }
+    const bool sixteenBit = (segment[0] >> 4) != 0;
+    const size_t tableBytes = sixteenBit ? 128 : 64;
+    if (1 + tableBytes > segment.size())
+    {
+        return 0;
+    }
+
+    // Average scaling factor against the standard table, as a percentage
+    double scaleSum = 0.0;
+    for (uint32 i = 0; i < 64; i++)
+    {
+        const uint8* entry = &segment[1 + (sixteenBit ? i * 2 : i)];
+        const uint16 value = sixteenBit ? (uint16)((entry[0] << 8) | entry[1]) : entry[0];
+        scaleSum += value * 100.0 / standardLuminanceTable[i];
+    }
+    const double scale = scaleSum / 64.0;
+
+    // Invert the IJG scaling: scale = 5000 / quality below 50, 200 - 2 * quality above
+    double quality = scale <= 100.0 ? (200.0 - scale) / 2.0 : 5000.0 / scale;
+    if (quality < 1.0)
+    {
+        quality = 1.0;
+    }
+    else if (quality > 100.0)
+    {
+        quality = 100.0;
+    }
+    return (uint8)(quality + 0.5);
+}
+
+CScanlineBlockReader::CScanlineBlockReader(const IImageFramePtr& frame, size_t rowBytes, uint32 height, size_t blockBytes, uint32 queueBlocks,
+                                           std::vector<uint8>& storage) :
+    m_frame(frame), m_rowBytes(rowBytes), m_rowStride((rowBytes + 63) & ~(size_t) 63), m_height(height),
+    m_blockStart(0), m_blockRows(0), m_block(nullptr), m_numSlots(std::max<uint32>(1, queueBlocks)),
+    m_nextBlock(0), m_filled(0), m_stopping(false)
+{
+    m_maxRows = (uint32) std::max<size_t>(1, std::min<size_t>(height, blockBytes / m_rowStride));
+    m_numBlocks = (height + m_maxRows - 1) / m_maxRows;
+
+    // Room for row -1 in each block, plus slack to align the start
+    m_slotBytes = (m_maxRows + 1) * m_rowStride;
+    const size_t needed = m_numSlots * m_slotBytes + 63;
+    if (storage.size() < needed)
+    {
+        storage.resize(needed);
+    }
+    m_slots = (uint8*) (((uintptr_t) storage.data() + 63) & ~(uintptr_t) 63);
+
+    if (queueBlocks > 1 && m_numBlocks > 1)
+    {
+        m_worker = std::thread(&CScanlineBlockReader::run, this);
+    }
+}
+
+CScanlineBlockReader::~CScanlineBlockReader()
+{
+    // The caller may stop early, with the worker still reading ahead
+    if (m_worker.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stopping = true;
+        }
+        m_blockReleased.notify_one();
+        m_worker.join();
+    }
+}
+
+uint32 CScanlineBlockReader::readBlock()
+{
+    if (m_nextBlock >= m_numBlocks)
+    {
+        m_blockRows = 0;
+        return 0;
+    }
+
+    const uint32 blockIndex = m_nextBlock;
+    if (!m_worker.joinable())
+    {
+        readRows(blockIndex);
+        m_nextBlock++;
+    }
+    else
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_blockFilled.wait(lock, [this] { return m_filled > m_nextBlock || m_error; });
+        if (m_error)
+        {
+            std::rethrow_exception(m_error);
+        }
+
+        // Moving on hands the current block back to the worker
+        m_nextBlock++;
+        lock.unlock();
+        m_blockReleased.notify_one();
+    }
+
+    m_block = slot(blockIndex);
+    m_blockStart = blockIndex * m_maxRows;
+    m_blockRows = rowsInBlock(blockIndex);
+    return m_blockRows;
+}
+
+void CScanlineBlockReader::readRows(uint32 blockIndex)
+{
+    uint8* block = slot(blockIndex);
+    if (blockIndex)
+    {
+        // Keep the last row of the previous block as row -1
+        memcpy(block, slot(blockIndex - 1) + rowsInBlock(blockIndex - 1) * m_rowStride, m_rowBytes);
+    }
+
+    for (uint32 y = 0, rows = rowsInBlock(blockIndex); y < rows; y++)
+    {
+        m_frame->readScanLine(block + (y + 1) * m_rowStride, m_rowBytes);
+    }
+}
+
+void CScanlineBlockReader::run()
+{
+    for (uint32 blockIndex = 0; blockIndex < m_numBlocks; blockIndex++)
+    {
+        {
+            // Wait for the slot to be free. The block being worked on was handed out as m_nextBlock - 1, and
+            // is only released by the following readBlock(). The previous block, which row -1 is copied from,
+            // is always still intact, as it is refilled only after this one.
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_blockReleased.wait(lock, [this, blockIndex] { return blockIndex + 1 < m_nextBlock + m_numSlots || m_stopping; });
+            if (m_stopping)
+            {
+                return;
+            }
+        }
+
+        try
+        {
+            readRows(blockIndex);
+        }
+        catch (...)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_error = std::current_exception();
+            m_blockFilled.notify_one();
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_filled = blockIndex + 1;
+        m_blockFilled.notify_one();
+    }
+}
+
+CAsyncFrameWriter::CAsyncFrameWriter(const IImageFrameWriterPtr& frameWriter, size_t rowBytes, uint32 queueDepth, std::vector<uint8>& rowStorage) :
+    m_frameWriter(frameWriter), m_rowBytes(rowBytes), m_queueDepth(queueDepth), m_rows(nullptr),
+    m_written(0), m_consumed(0), m_finished(false)
+{
+    if (m_queueDepth)
+    {
+        if (rowStorage.size() < m_rowBytes * m_queueDepth)
+        {
+            rowStorage.resize(m_rowBytes * m_queueDepth);
+        }
+        m_rows = rowStorage.data();
+        m_worker = std::thread(&CAsyncFrameWriter::run, this);
+    }
+}
+
+CAsyncFrameWriter::~CAsyncFrameWriter()
+{
+    // Only reached without flushData() if the conversion was abandoned
+    stop();
+}
+
+void CAsyncFrameWriter::writeScanLine(const void* row)
+{
+    if (!m_queueDepth)
+    {
+        m_frameWriter->writeScanLine(row);
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_rowConsumed.wait(lock, [this] { return m_written - m_consumed < m_queueDepth || m_error; });
+    if (m_error)
+    {
+        std::rethrow_exception(m_error);
+    }
+
+    // The slot is free, so it can be filled without holding the lock
+    uint8* slot = &m_rows[(m_written % m_queueDepth) * m_rowBytes];
+    lock.unlock();
+    memcpy(slot, row, m_rowBytes);
+    lock.lock();
+
+    m_written++;
+    m_rowQueued.notify_one();
+}
+
+void CAsyncFrameWriter::writeScanLines(const uint8* const* rows, uint32 count)
+{
+    if (!m_queueDepth)
+    {
+        for (uint32 i = 0; i < count; i++)
+        {
+            m_frameWriter->writeScanLine(rows[i]);
+        }
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (count)
+    {
+        m_rowConsumed.wait(lock, [this] { return m_written - m_consumed < m_queueDepth || m_error; });
+        if (m_error)
+        {
+            std::rethrow_exception(m_error);
+        }
+
+        // Fill every free slot, without holding the lock
+        const uint32 rowsToCopy = (uint32) std::min<uint64>(count, m_queueDepth - (m_written - m_consumed));
+        const uint64 first = m_written;
+        lock.unlock();
+        for (uint32 i = 0; i < rowsToCopy; i++)
+        {
+            memcpy(&m_rows[((first + i) % m_queueDepth) * m_rowBytes], rows[i], m_rowBytes);
+        }
+        lock.lock();
+
+        m_written += rowsToCopy;
+        m_rowQueued.notify_one();
+        rows += rowsToCopy;
+        count -= rowsToCopy;
+    }
+}
+
+void CAsyncFrameWriter::flushData()
+{
+    stop();
+    if (m_error)
+    {
+        std::rethrow_exception(m_error);
+    }
+    m_frameWriter->flushData();
+}
+
+void CAsyncFrameWriter::stop()
+{
+    if (!m_worker.joinable())
+    {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_finished = true;
+    }
+    m_rowQueued.notify_one();
+    m_worker.join();
+}
+
+void CAsyncFrameWriter::run()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for (;;)
+    {
+        m_rowQueued.wait(lock, [this] { return m_consumed < m_written || m_finished; });
+        if (m_consumed == m_written)
+        {
+            // Finished, and everything has been written
+            return;
+        }
+
+        // The writer may compress; do that outside the lock so the producer can keep going. Take up to a
+        // quarter of the queue at a time, so a block of rows costs a few round trips through the lock while
+        // the producer still gets slots back regularly.
+        const uint64 first = m_consumed;
+        const uint64 available = std::min<uint64>(m_written - m_consumed, std::max<uint32>(1, m_queueDepth / 4));
+        lock.unlock();
+        try
+        {
+            for (uint64 i = 0; i < available; i++)
+            {
+                m_frameWriter->writeScanLine(&m_rows[((first + i) % m_queueDepth) * m_rowBytes]);
+            }
+        }
+        catch (...)
+        {
+            lock.lock();
+            m_error = std::current_exception();
+            m_rowConsumed.notify_one();
+            return;
+        }
+        lock.lock();
+
+        m_consumed += available;
+        m_rowConsumed.notify_one();
+    }
+}
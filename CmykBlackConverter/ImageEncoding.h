@@ -0,0 +1,134 @@
+/* -----------------------------------------------------------------------
+ *  <copyright file="ImageEncoding.h" company="Global Graphics Software Ltd">
+ *      Copyright (c) 2023 Global Graphics Software Ltd. All rights reserved.
+ *  </copyright>
+ *  <summary>
+ *  This example is provided on an "as is" basis and without warranty of any kind.
+ *  Global Graphics Software Ltd. does not warrant or make any representations regarding the use or
+ *  results of use of this example.
+ *  </summary>
+ * -----------------------------------------------------------------------
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <jawsmako/jawsmako.h>
+
+using namespace JawsMako;
+
+// How converted images are encoded
+enum eImageEncoding
+{
+    eIEAuto,    // DCT if the source was DCT and the result is continuous tone, otherwise raw
+    eIERaw,     // Raw image data, compressed by the PDF output (Flate)
+    eIEDCT      // DCT (JPEG) for continuous tone results, otherwise raw
+};
+
+// Estimate the IJG quality setting used for a JPEG stream from its first quantization table, reading the open
+// stream only as far as that table. Returns 0 if no quantization table could be found.
+uint8 estimateJpegQuality(const IInputStreamPtr& stream);
+
+// Reads an image frame a block of rows at a time into a reusable buffer, so the kernels can work through
+// many rows between reads. Each row starts on a 64 byte boundary. The last row of the previous block is
+// kept just before the first row of the next, so row(-1) is always the row read before row(0).
+// When given a queue of blocks, decoding runs ahead on a worker thread, filling up to queueBlocks blocks
+// while the caller works on the current one. With a queue of zero blocks rows are read directly.
+class CScanlineBlockReader
+{
+public:
+    CScanlineBlockReader(const IImageFramePtr& frame, size_t rowBytes, uint32 height, size_t blockBytes, uint32 queueBlocks,
+                         std::vector<uint8>& storage);
+    ~CScanlineBlockReader();
+
+    CScanlineBlockReader(const CScanlineBlockReader&) = delete;
+    CScanlineBlockReader& operator=(const CScanlineBlockReader&) = delete;
+
+    // Read the next block, releasing the current one. Returns the number of rows read, which is zero at the
+    // end of the image. Any error raised on the worker thread is rethrown here.
+    uint32 readBlock();
+
+    // The image row number of row(0)
+    uint32 blockStart() const { return m_blockStart; }
+
+    // The most rows a block can hold
+    uint32 maxRows() const { return m_maxRows; }
+
+    uint8* row(int32 index) const { return m_block + (index + 1) * m_rowStride; }
+
+private:
+    uint8* slot(uint32 blockIndex) const { return m_slots + (blockIndex % m_numSlots) * m_slotBytes; }
+    uint32 rowsInBlock(uint32 blockIndex) const { return std::min(m_maxRows, m_height - blockIndex * m_maxRows); }
+    void readRows(uint32 blockIndex);
+    void run();
+
+    IImageFramePtr m_frame;
+    size_t m_rowBytes;
+    size_t m_rowStride;
+    uint32 m_height;
+    uint32 m_maxRows;
+    uint32 m_numBlocks;
+    uint32 m_blockStart;
+    uint32 m_blockRows;
+    uint8* m_block;                 // Row -1 followed by up to m_maxRows rows
+
+    uint8* m_slots;                 // Ring of m_numSlots blocks
+    size_t m_slotBytes;
+    uint32 m_numSlots;
+    uint32 m_nextBlock;             // The next block readBlock() returns
+    uint32 m_filled;                // Blocks read by the worker
+    bool m_stopping;
+    std::exception_ptr m_error;
+    std::mutex m_mutex;
+    std::condition_variable m_blockFilled;
+    std::condition_variable m_blockReleased;
+    std::thread m_worker;
+};
+
+// Writes scanlines to an image frame writer. When given a queue depth, the writer (and so the
+// compression of the image data) runs on a worker thread, with the caller blocking only when
+// queueDepth rows are waiting to be written. With a queue depth of zero rows are written directly.
+// The queue is held in rowStorage, which is grown if needed and may be reused for later images.
+class CAsyncFrameWriter
+{
+public:
+    CAsyncFrameWriter(const IImageFrameWriterPtr& frameWriter, size_t rowBytes, uint32 queueDepth, std::vector<uint8>& rowStorage);
+    ~CAsyncFrameWriter();
+
+    CAsyncFrameWriter(const CAsyncFrameWriter&) = delete;
+    CAsyncFrameWriter& operator=(const CAsyncFrameWriter&) = delete;
+
+    // The row is copied, so the caller may reuse its buffer immediately
+    void writeScanLine(const void* row);
+
+    // Write a block of rows, taking the lock once for as many rows as there is room for
+    void writeScanLines(const uint8* const* rows, uint32 count);
+
+    // Wait for all queued rows to be written and flush the frame writer. Any error raised on the
+    // worker thread is rethrown here.
+    void flushData();
+
+private:
+    void run();
+    void stop();
+
+    IImageFrameWriterPtr m_frameWriter;
+    size_t m_rowBytes;
+    uint32 m_queueDepth;
+
+    uint8* m_rows;                  // Ring of m_queueDepth rows
+    uint64 m_written;               // Rows handed to writeScanLine()
+    uint64 m_consumed;              // Rows written by the worker
+    bool m_finished;
+    std::exception_ptr m_error;
+    std::mutex m_mutex;
+    std::condition_variable m_rowQueued;
+    std::condition_variable m_rowConsumed;
+    std::thread m_worker;
+};
@@ -0,0 +1,335 @@
+/* -----------------------------------------------------------------------
+ *  <copyright file="ImageIndex.cpp" company="Global Graphics Software Ltd">
+ *      Copyright (c) 2023 Global Graphics Software Ltd. All rights reserved.
+ *  </copyright>
+ *  <summary>
+ *  This example is provided on an "as is" basis and without warranty of any kind.
+ *  Global Graphics Software Ltd. does not warrant or make any representations regarding the use or
+ *  results of use of this example.
+ *  </summary>
+ * -----------------------------------------------------------------------
+ */
+
+#include "ImageIndex.h"
+
+#include <cstring>
+#include <filesystem>
+#include <functional>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace fs = std::filesystem;
+
+static const char indexMagic[8] = { 'C', 'B', 'C', 'I', 'D', 'X', '0', '1' };
+
+// The table of entries. Lookups probe a few entries from the one the key hashes to.
+static const uint32 numIndexEntries = 64 * 1024;
+static const uint32 maxProbes = 32;
+
+// The file is grown by at least this much when row maps no longer fit
+static const uint64 indexGrowBytes = 1024 * 1024;
+
+struct CIndexHeader
+{
+    char magic[8];
+    uint32 numEntries;
+    uint32 reserved;
+    uint64 usedBytes;               // The table plus the row maps stored so far
+    uint8 padding[40];
+};
+
+struct CImageIndex::CEntry
+{
+    CKey key;
+    uint32 state;                   // eImageState; eISUnknown for an empty entry
+    uint32 height;
+    uint64 rowMapOffset;            // 0 if no row map was stored
+    uint8 padding[16];
+};
+
+static const uint64 tableBytes = sizeof(CIndexHeader) + (uint64) numIndexEntries * 64;
+
+// Holds the file lock for a scope
+class CIndexFileLock
+{
+public:
+    CIndexFileLock(std::function<void()> unlock) : m_unlock(unlock) {}
+    ~CIndexFileLock() { m_unlock(); }
+
+private:
+    std::function<void()> m_unlock;
+};
+
+CImageIndex::CImageIndex(const std::string& path) :
+    m_mapping(nullptr), m_data(nullptr), m_mappedBytes(0)
+{
+    static_assert(sizeof(CIndexHeader) == 64 && sizeof(CEntry) == 64, "Index layout");
+
+#ifdef _WIN32
+    m_file = CreateFileW(fs::path(path).wstring().c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+                         OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (m_file == INVALID_HANDLE_VALUE)
+#else
+    m_file = open(path.c_str(), O_RDWR | O_CREAT, 0666);
+    if (m_file < 0)
+#endif
+    {
+        throwEDLError(JM_ERR_GENERAL, L"Unable to open image index");
+    }
+
+    try
+    {
+        initialize();
+    }
+    catch (...)
+    {
+        unmapFile();
+#ifdef _WIN32
+        CloseHandle(m_file);
+#else
+        close(m_file);
+#endif
+        throw;
+    }
+}
+
+CImageIndex::~CImageIndex()
+{
+    unmapFile();
+#ifdef _WIN32
+    CloseHandle(m_file);
+#else
+    close(m_file);
+#endif
+}
+
+// Create the table in a new file, or check an existing one
+void CImageIndex::initialize()
+{
+    lockFile(true);
+    CIndexFileLock fileLock([this] { unlockFile(); });
+
+    const uint64 size = fileSize();
+    if (size == 0)
+    {
+        mapFile(tableBytes);
+        CIndexHeader* header = (CIndexHeader*) m_data;
+        header->numEntries = numIndexEntries;
+        header->usedBytes = tableBytes;
+        memcpy(header->magic, indexMagic, sizeof(indexMagic));
+        return;
+    }
+
+    if (size < tableBytes)
+    {
+        throwEDLError(JM_ERR_GENERAL, L"Not an image index");
+    }
+    mapFile(size);
+    const CIndexHeader* header = (const CIndexHeader*) m_data;
+    if (memcmp(header->magic, indexMagic, sizeof(indexMagic)) != 0 || header->numEntries != numIndexEntries)
+    {
+        throwEDLError(JM_ERR_GENERAL, L"Not an image index");
+    }
+}
+
+CImageIndex::eImageState CImageIndex::lookup(const CKey& key, std::vector<uint64>* fullInkRows)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    lockFile(false);
+    CIndexFileLock fileLock([this] { unlockFile(); });
+
+    // Another process may have grown the file
+    const uint64 size = fileSize();
+    if (size != m_mappedBytes)
+    {
+        mapFile(size);
+    }
+
+    const CEntry* entry = findEntry(key, false);
+    if (!entry)
+    {
+        return eISUnknown;
+    }
+    if (entry->state != eISRichBlack || !fullInkRows)
+    {
+        return (eImageState) entry->state;
+    }
+
+    const uint64 words = (entry->height + 63) / 64;
+    if (!entry->rowMapOffset || entry->rowMapOffset + words * sizeof(uint64) > m_mappedBytes)
+    {
+        return eISUnknown;
+    }
+    fullInkRows->resize((size_t) words);
+    memcpy(fullInkRows->data(), m_data + entry->rowMapOffset, (size_t) words * sizeof(uint64));
+    return eISRichBlack;
+}
+
+void CImageIndex::store(const CKey& key, bool richBlack, uint32 height, const std::vector<uint64>* fullInkRows)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    lockFile(true);
+    CIndexFileLock fileLock([this] { unlockFile(); });
+
+    const uint64 size = fileSize();
+    if (size != m_mappedBytes)
+    {
+        mapFile(size);
+    }
+
+    CEntry* entry = findEntry(key, true);
+    if (!entry)
+    {
+        // Crowded; this is only a cache
+        return;
+    }
+    const bool addRowMap = richBlack && fullInkRows && !entry->rowMapOffset;
+    if (entry->state != eISUnknown && !addRowMap)
+    {
+        // Already known
+        return;
+    }
+
+    uint64 rowMapOffset = entry->rowMapOffset;
+    if (addRowMap)
+    {
+        const uint64 rowMapBytes = fullInkRows->size() * sizeof(uint64);
+        rowMapOffset = ((CIndexHeader*) m_data)->usedBytes;
+        if (rowMapOffset + rowMapBytes > m_mappedBytes)
+        {
+            // Growing the file moves the mapping
+            const size_t entryOffset = (uint8*) entry - m_data;
+            mapFile(rowMapOffset + rowMapBytes + indexGrowBytes);
+            entry = (CEntry*) (m_data + entryOffset);
+        }
+        memcpy(m_data + rowMapOffset, fullInkRows->data(), (size_t) rowMapBytes);
+        ((CIndexHeader*) m_data)->usedBytes = rowMapOffset + rowMapBytes;
+    }
+
+    entry->height = height;
+    entry->rowMapOffset = rowMapOffset;
+    memcpy(entry->key, key, sizeof(CKey));
+    entry->state = richBlack ? eISRichBlack : eISClean;
+}
+
+// Find the entry for a key, or for an insert, the empty entry it would go in
+CImageIndex::CEntry* CImageIndex::findEntry(const CKey& key, bool forInsert)
+{
+    CEntry* entries = (CEntry*) (m_data + sizeof(CIndexHeader));
+    uint32 slot = ((uint32) key[0] | (uint32) key[1] << 8 | (uint32) key[2] << 16 | (uint32) key[3] << 24) % numIndexEntries;
+
+    for (uint32 probe = 0; probe < maxProbes; probe++, slot = (slot + 1) % numIndexEntries)
+    {
+        CEntry* entry = &entries[slot];
+        if (entry->state == eISUnknown)
+        {
+            return forInsert ? entry : nullptr;
+        }
+        if (memcmp(entry->key, key, sizeof(CKey)) == 0)
+        {
+            return entry;
+        }
+    }
+    return nullptr;
+}
+
+void CImageIndex::lockFile(bool exclusive)
+{
+#ifdef _WIN32
+    OVERLAPPED overlapped = {};
+    if (!LockFileEx(m_file, exclusive ? LOCKFILE_EXCLUSIVE_LOCK : 0, 0, MAXDWORD, MAXDWORD, &overlapped))
+#else
+    if (flock(m_file, exclusive ? LOCK_EX : LOCK_SH) != 0)
+#endif
+    {
+        throwEDLError(JM_ERR_GENERAL, L"Unable to lock image index");
+    }
+}
+
+void CImageIndex::unlockFile()
+{
+#ifdef _WIN32
+    OVERLAPPED overlapped = {};
+    UnlockFileEx(m_file, 0, MAXDWORD, MAXDWORD, &overlapped);
+#else
+    flock(m_file, LOCK_UN);
+#endif
+}
+
+uint64 CImageIndex::fileSize()
+{
+#ifdef _WIN32
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(m_file, &size))
+    {
+        throwEDLError(JM_ERR_GENERAL, L"Unable to read image index");
+    }
+    return (uint64) size.QuadPart;
+#else
+    struct stat status;
+    if (fstat(m_file, &status) != 0)
+    {
+        throwEDLError(JM_ERR_GENERAL, L"Unable to read image index");
+    }
+    return (uint64) status.st_size;
+#endif
+}
+
+// Map size bytes of the file, extending it if it is shorter
+void CImageIndex::mapFile(uint64 size)
+{
+    unmapFile();
+
+#ifdef _WIN32
+    // A mapping larger than the file extends it
+    m_mapping = CreateFileMappingW(m_file, nullptr, PAGE_READWRITE, (DWORD) (size >> 32), (DWORD) size, nullptr);
+    if (m_mapping)
+    {
+        m_data = (uint8*) MapViewOfFile(m_mapping, FILE_MAP_ALL_ACCESS, 0, 0, (SIZE_T) size);
+    }
+#else
+    if (fileSize() < size && ftruncate(m_file, (off_t) size) != 0)
+    {
+        throwEDLError(JM_ERR_GENERAL, L"Unable to grow image index");
+    }
+    void* data = mmap(nullptr, (size_t) size, PROT_READ | PROT_WRITE, MAP_SHARED, m_file, 0);
+    m_data = data == MAP_FAILED ? nullptr : (uint8*) data;
+#endif
+
+    if (!m_data)
+    {
+        unmapFile();
+        throwEDLError(JM_ERR_GENERAL, L"Unable to map image index");
+    }
+    m_mappedBytes = size;
+}
+
+void CImageIndex::unmapFile()
+{
+#ifdef _WIN32
+    if (m_data)
+    {
+        UnmapViewOfFile(m_data);
+    }
+    if (m_mapping)
+    {
+        CloseHandle(m_mapping);
+    }
+#else
+    if (m_data)
+    {
+        munmap(m_data, (size_t) m_mappedBytes);
+    }
+#endif
+    m_mapping = nullptr;
+    m_data = nullptr;
+    m_mappedBytes = 0;
+}
@@ -0,0 +1,78 @@
+/* -----------------------------------------------------------------------
+ *  <copyright file="ImageIndex.h" company="Global Graphics Software Ltd">
+ *      Copyright (c) 2023 Global Graphics Software Ltd. All rights reserved.
+ *  </copyright>
+ *  <summary>
+ *  This example is provided on an "as is" basis and without warranty of any kind.
+ *  Global Graphics Software Ltd. does not warrant or make any representations regarding the use or
+ *  results of use of this example.
+ *  </summary>
+ * -----------------------------------------------------------------------
+ */
+
+#pragma once
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <jawsmako/jawsmako.h>
+
+#include "ContentHash.h"
+
+using namespace JawsMako;
+
+#ifdef _WIN32
+typedef void* IndexFileHandle;
+#else
+typedef int IndexFileHandle;
+#endif
+
+// A persistent index of image detection results, keyed by a hash of the image data and how it is decoded, so that images that
+// recur across documents need not be decoded again. Clean images are skipped entirely; for images with
+// rich black the map of rows with full K is kept, so only the conversion pass is needed.
+// The index is a memory mapped file: a fixed table of entries followed by the row maps. Any number of
+// processes (and threads) may share it; each lookup or store holds a lock on the file. The index is a
+// cache, so when the table is crowded new entries are simply not added.
+class CImageIndex
+{
+public:
+    enum eImageState
+    {
+        eISUnknown,
+        eISClean,
+        eISRichBlack
+    };
+
+    typedef uint8 CKey[CContentHash::eDigestBytes];
+
+    explicit CImageIndex(const std::string& path);
+    ~CImageIndex();
+
+    CImageIndex(const CImageIndex&) = delete;
+    CImageIndex& operator=(const CImageIndex&) = delete;
+
+    // Look up an image. If fullInkRows is given, rich black is only reported for an entry with a row map,
+    // which is copied out.
+    eImageState lookup(const CKey& key, std::vector<uint64>* fullInkRows);
+
+    // Record an image. The row map, if given, has a bit for each of height rows.
+    void store(const CKey& key, bool richBlack, uint32 height, const std::vector<uint64>* fullInkRows);
+
+private:
+    struct CEntry;
+
+    void lockFile(bool exclusive);
+    void unlockFile();
+    uint64 fileSize();
+    void mapFile(uint64 size);
+    void unmapFile();
+    void initialize();
+    CEntry* findEntry(const CKey& key, bool forInsert);
+
+    IndexFileHandle m_file;
+    void* m_mapping;                // The file mapping object, on Windows
+    uint8* m_data;
+    uint64 m_mappedBytes;
+    std::mutex m_mutex;             // The file lock is per process, so threads also need this
+};
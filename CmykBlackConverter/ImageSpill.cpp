@@ -0,0 +1,132 @@
+/* -----------------------------------------------------------------------
+ *  <copyright file="ImageSpill.cpp" company="Global Graphics Software Ltd">
+ *      Copyright (c) 2023 Global Graphics Software Ltd. All rights reserved.
+ *  </copyright>
+ *  <summary>
+ *  This example is provided on an "as is" basis and without warranty of any kind.
+ *  Global Graphics Software Ltd. does not warrant or make any representations regarding the use or
+ *  results of use of this example.
+ *  </summary>
+ * -----------------------------------------------------------------------
+ */
+
+#include "ImageSpill.h"
+
+#include <memory>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#endif
+
+#include "MemoryStreams.h"
+
+// Encoded data is written to the file in chunks of about this size
+static const size_t spillWriteBytes = 1024 * 1024;
+
+void runLengthEncode(const uint8* data, size_t length, std::vector<uint8>& out)
+{
+    size_t i = 0;
+    while (i < length)
+    {
+        // A run of two or more bytes: 257 - count, then the byte
+        size_t run = 1;
+        while (i + run < length && run < 128 && data[i + run] == data[i])
+        {
+            run++;
+        }
+        if (run > 1)
+        {
+            out.push_back((uint8) (257 - run));
+            out.push_back(data[i]);
+            i += run;
+            continue;
+        }
+
+        // Literal bytes up to the start of the next run: count - 1, then the bytes
+        const size_t start = i++;
+        while (i < length && i - start < 128 && !(i + 1 < length && data[i] == data[i + 1]))
+        {
+            i++;
+        }
+        out.push_back((uint8) (i - start - 1));
+        out.insert(out.end(), data + start, data + i);
+    }
+}
+
+static FILE* openSpillFile()
+{
+#ifdef _WIN32
+    // tmpfile() uses the root of the current drive on Windows, so make the name ourselves
+    wchar_t directory[MAX_PATH + 1];
+    wchar_t path[MAX_PATH + 1];
+    if (!GetTempPathW(MAX_PATH + 1, directory) || !GetTempFileNameW(directory, L"cbc", 0, path))
+    {
+        return nullptr;
+    }
+    return _wfopen(path, L"w+bTD");
+#else
+    return tmpfile();
+#endif
+}
+
+CImageSpillFile::CImageSpillFile(size_t rowBytes) :
+    m_file(openSpillFile()), m_rowBytes(rowBytes)
+{
+    if (!m_file)
+    {
+        throwEDLError(JM_ERR_GENERAL, L"Unable to create image spill file");
+    }
+    m_encoded.reserve(spillWriteBytes + rowBytes * 2);
+}
+
+CImageSpillFile::~CImageSpillFile()
+{
+    // Only still open if finish() was never reached
+    if (m_file)
+    {
+        fclose(m_file);
+    }
+}
+
+void CImageSpillFile::writeScanLines(const uint8* const* rows, uint32 count)
+{
+    for (uint32 i = 0; i < count; i++)
+    {
+        runLengthEncode(rows[i], m_rowBytes, m_encoded);
+        if (m_encoded.size() >= spillWriteBytes)
+        {
+            flushEncoded();
+        }
+    }
+}
+
+IRAInputStreamPtr CImageSpillFile::finish()
+{
+    // End of data marker
+    m_encoded.push_back(128);
+    flushEncoded();
+
+    if (fflush(m_file) != 0)
+    {
+        throwEDLError(JM_ERR_GENERAL, L"Unable to write image spill file");
+    }
+
+    // The mapping takes the file over, and the output reads the image from start to end
+    FILE* file = m_file;
+    m_file = nullptr;
+    const CFileMappingPtr mapping = std::make_shared<CFileMapping>(file);
+    mapping->adviseSequential();
+    return createMappedInputStream(mapping);
+}
+
+void CImageSpillFile::flushEncoded()
+{
+    if (fwrite(m_encoded.data(), 1, m_encoded.size(), m_file) != m_encoded.size())
+    {
+        throwEDLError(JM_ERR_GENERAL, L"Unable to write image spill file");
+    }
+    m_encoded.clear();
+}
@@ -0,0 +1,50 @@
+/* -----------------------------------------------------------------------
+ *  <copyright file="ImageSpill.h" company="Global Graphics Software Ltd">
+ *      Copyright (c) 2023 Global Graphics Software Ltd. All rights reserved.
+ *  </copyright>
+ *  <summary>
+ *  This example is provided on an "as is" basis and without warranty of any kind.
+ *  Global Graphics Software Ltd. does not warrant or make any representations regarding the use or
+ *  results of use of this example.
+ *  </summary>
+ * -----------------------------------------------------------------------
+ */
+
+#pragma once
+
+#include <cstdio>
+#include <vector>
+
+#include <jawsmako/jawsmako.h>
+
+using namespace JawsMako;
+
+// Run length encode data as read by the PDF RunLengthDecode filter, appending to out
+void runLengthEncode(const uint8* data, size_t length, std::vector<uint8>& out);
+
+// Holds the data of a converted image in a temporary file instead of memory, for images larger than the
+// image memory budget. Rows are run length encoded as they are written, which suits converted images
+// well: flat black and zeroed CMY channels make long runs. finish() returns a stream over the file, which
+// is memory mapped so that reading it back for output comes straight from the page cache. The file is
+// deleted once the stream is released.
+class CImageSpillFile
+{
+public:
+    explicit CImageSpillFile(size_t rowBytes);
+    ~CImageSpillFile();
+
+    CImageSpillFile(const CImageSpillFile&) = delete;
+    CImageSpillFile& operator=(const CImageSpillFile&) = delete;
+
+    void writeScanLines(const uint8* const* rows, uint32 count);
+
+    // Finish writing. The stream takes over the file.
+    IRAInputStreamPtr finish();
+
+private:
+    void flushEncoded();
+
+    FILE* m_file;
+    size_t m_rowBytes;
+    std::vector<uint8> m_encoded;   // Encoded data not yet written to the file
+};
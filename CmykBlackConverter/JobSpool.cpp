@@ -0,0 +1,354 @@
+/* -----------------------------------------------------------------------
+ *  <copyright file="JobSpool.cpp" company="Global Graphics Software Ltd">
+ *      Copyright (c) 2023 Global Graphics Software Ltd. All rights reserved.
+ *  </copyright>
+ *  <summary>
+ *  This example is provided on an "as is" basis and without warranty of any kind.
+ *  Global Graphics Software Ltd. does not warrant or make any representations regarding the use or
+ *  results of use of this example.
+ *  </summary>
+ * -----------------------------------------------------------------------
+ */
+
+#include "JobSpool.h"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <thread>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace fs = std::filesystem;
+
+static const std::string jobExtension = ".pdf";
+static const std::string attemptSuffix = ".attempt";
+static const std::string leaseExtension = ".lease";
+static const std::string doneExtension = ".done";
+static const std::string failedExtension = ".failed";
+static const std::string resultSuffix = ".result";
+static const std::string statsSuffix = ".stats.json";
+static const std::string tempExtension = ".tmp";
+
+// How often to look for new jobs when there are none
+static const std::chrono::seconds pollInterval(2);
+
+// A job whose lease has gone stale this many times has crashed or stalled every instance that took it, and is
+// marked failed rather than put back again
+static const uint32_t maxJobAttempts = 3;
+
+static bool endsWith(const std::string& text, const std::string& suffix, bool ignoreCase = false)
+{
+    if (text.size() < suffix.size())
+    {
+        return false;
+    }
+    return std::equal(suffix.begin(), suffix.end(), text.end() - suffix.size(), [ignoreCase](char a, char b)
+    {
+        return ignoreCase ? std::tolower((unsigned char) a) == std::tolower((unsigned char) b) : a == b;
+    });
+}
+
+// A queued job: a PDF file that isn't one of the results, or one put back after attempts that did not finish,
+// "name.pdf.attempt<N>". Gives the job's own name, and the number of attempts made so far.
+static bool isJob(const std::string& name, std::string& jobName, uint32_t& attempts)
+{
+    jobName = name;
+    attempts = 0;
+
+    const size_t attemptStart = name.rfind(attemptSuffix);
+    if (attemptStart != std::string::npos && attemptStart + attemptSuffix.size() < name.size()
+        && std::all_of(name.begin() + attemptStart + attemptSuffix.size(), name.end(), [](char c) { return std::isdigit((unsigned char) c) != 0; }))
+    {
+        jobName = name.substr(0, attemptStart);
+        attempts = static_cast<uint32_t>(std::strtoul(name.c_str() + attemptStart + attemptSuffix.size(), nullptr, 10));
+    }
+    return endsWith(jobName, jobExtension, true) && !endsWith(jobName, resultSuffix + jobExtension, true);
+}
+
+static std::string jsonString(const std::string& text)
+{
+    std::string quoted = "\"";
+    for (const char c : text)
+    {
+        if (c == '"' || c == '\\')
+        {
+            quoted += '\\';
+        }
+        quoted += static_cast<unsigned char>(c) < 0x20 ? ' ' : c;
+    }
+    return quoted + "\"";
+}
+
+// Write a file under a temporary name and rename it into place, so it is never seen half written
+static void writeFileAtomically(const fs::path& path, const std::string& content, const std::string& owner)
+{
+    const fs::path temp = path.string() + "." + owner + tempExtension;
+    {
+        std::ofstream file(temp, std::ios::binary);
+        file << content;
+    }
+    std::error_code error;
+    fs::rename(temp, path, error);
+    if (error)
+    {
+        fs::remove(temp, error);
+    }
+}
+
+CJobSpool::CJobSpool(const std::string& directory, const std::string& resultExtension, uint32_t leaseSeconds, uint32_t jobSeconds) :
+    m_directory(directory), m_resultExtension(resultExtension), m_leaseSeconds(std::max(1u, leaseSeconds)), m_jobSeconds(jobSeconds),
+    m_jobsDone(0), m_jobsFailed(0), m_leasesRecovered(0), m_jobsTimedOut(0)
+{
+    fs::create_directories(m_directory);
+
+    // Identifies the lease holder to anyone looking at the spool
+#ifdef _WIN32
+    char host[MAX_COMPUTERNAME_LENGTH + 1] = "";
+    DWORD hostLength = sizeof(host);
+    GetComputerNameA(host, &hostLength);
+    const unsigned long processId = GetCurrentProcessId();
+#else
+    char host[256] = "";
+    gethostname(host, sizeof(host) - 1);
+    const unsigned long processId = static_cast<unsigned long>(getpid());
+#endif
+    m_owner = std::string(host) + "-" + std::to_string(processId);
+}
+
+void CJobSpool::run(const CJobFunction& convert, bool drain)
+{
+    for (;;)
+    {
+        recoverStaleLeases();
+
+        std::string jobName;
+        std::string leasePath;
+        if (claim(jobName, leasePath))
+        {
+            runJob(convert, jobName, leasePath);
+            continue;
+        }
+
+        if (drain)
+        {
+            return;
+        }
+        std::this_thread::sleep_for(pollInterval);
+    }
+}
+
+// Claim the oldest queued job. Another instance may claim any of them first, in which case the rename fails
+// and the next is tried.
+bool CJobSpool::claim(std::string& jobName, std::string& leasePath)
+{
+    std::error_code error;
+    std::vector<std::pair<fs::file_time_type, fs::path>> queued;
+    for (const fs::directory_entry& item : fs::directory_iterator(m_directory, error))
+    {
+        std::error_code itemError;
+        std::string name;
+        uint32_t attempts;
+        const fs::file_time_type queuedAt = item.last_write_time(itemError);
+        if (!itemError && item.is_regular_file(itemError) && isJob(item.path().filename().string(), name, attempts))
+        {
+            queued.emplace_back(queuedAt, item.path());
+        }
+    }
+    std::sort(queued.begin(), queued.end());
+
+    for (const auto& job : queued)
+    {
+        // The lease keeps any attempt count, so that it carries over if this instance dies too
+        const std::string lease = job.second.string() + "." + m_owner + leaseExtension;
+        fs::rename(job.second, lease, error);
+        if (!error)
+        {
+            // The lease runs from now, not from when the job was queued
+            fs::last_write_time(lease, fs::file_time_type::clock::now(), error);
+            uint32_t attempts;
+            isJob(job.second.filename().string(), jobName, attempts);
+            leasePath = lease;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Put back the jobs of instances that have stopped renewing their leases, counting the attempt. A job that has
+// used up its attempts is marked failed instead, so that a document that crashes the SDK is not handed from
+// instance to instance forever.
+void CJobSpool::recoverStaleLeases()
+{
+    std::error_code error;
+    // Leases are renewed with the clock of the instance holding them, and checked here against this one's, so the
+    // clocks of the machines sharing the spool must agree to well within the lease time
+    const fs::file_time_type now = fs::file_time_type::clock::now();
+    for (const fs::directory_entry& item : fs::directory_iterator(m_directory, error))
+    {
+        const std::string name = item.path().filename().string();
+        if (!endsWith(name, leaseExtension))
+        {
+            continue;
+        }
+
+        std::error_code itemError;
+        const fs::file_time_type renewed = item.last_write_time(itemError);
+        if (itemError || now - renewed < std::chrono::seconds(m_leaseSeconds))
+        {
+            continue;
+        }
+
+        // "name.pdf[.attempt<N>].<owner>.lease" goes back to "name.pdf.attempt<N+1>", or to "name.pdf.failed" once the
+        // attempts are used up. Only one instance can win the rename.
+        const size_t jobEnd = name.rfind(jobExtension + ".");
+        if (jobEnd == std::string::npos)
+        {
+            continue;
+        }
+        const std::string jobName = name.substr(0, jobEnd + jobExtension.size());
+        uint32_t attempts = 0;
+        const size_t attemptStart = jobEnd + jobExtension.size();
+        if (name.compare(attemptStart, attemptSuffix.size(), attemptSuffix) == 0)
+        {
+            attempts = static_cast<uint32_t>(std::strtoul(name.c_str() + attemptStart + attemptSuffix.size(), nullptr, 10));
+        }
+        attempts++;
+
+        const bool givingUp = attempts >= maxJobAttempts;
+        const std::string recovered = givingUp ? jobName + failedExtension : jobName + attemptSuffix + std::to_string(attempts);
+        fs::rename(item.path(), item.path().parent_path() / recovered, itemError);
+        if (itemError)
+        {
+            continue;
+        }
+
+        m_leasesRecovered++;
+        if (givingUp)
+        {
+            std::string statsJson = "{\n";
+            statsJson += "  \"job\": " + jsonString(jobName) + ",\n";
+            statsJson += "  \"owner\": " + jsonString(m_owner) + ",\n";
+            statsJson += "  \"exitCode\": 1,\n";
+            statsJson += "  \"attempts\": " + std::to_string(attempts) + "\n";
+            statsJson += "}\n";
+            writeFileAtomically(item.path().parent_path() / (jobName.substr(0, jobName.size() - jobExtension.size()) + statsSuffix), statsJson, m_owner);
+            std::cerr << "Gave up on " << jobName << " after " << attempts << " attempts" << std::endl;
+        }
+        else
+        {
+            std::cerr << "Recovered stale lease " << name << std::endl;
+        }
+    }
+}
+
+void CJobSpool::runJob(const CJobFunction& convert, const std::string& jobName, const std::string& leasePath)
+{
+    const fs::path directory = fs::path(leasePath).parent_path();
+    const std::string stem = jobName.substr(0, jobName.size() - jobExtension.size());
+    const fs::path resultPath = directory / (stem + resultSuffix + m_resultExtension);
+    const fs::path tempResultPath = resultPath.string() + "." + m_owner + tempExtension;
+
+    // Renew the lease every third of the lease time while converting, until the job's time is up. A conversion
+    // that hangs then lets its lease go stale, and another instance takes the job over.
+    const auto start = std::chrono::steady_clock::now();
+    std::mutex heartbeatMutex;
+    std::condition_variable heartbeatStop;
+    bool converted = false;
+    std::thread heartbeat([&]
+    {
+        std::unique_lock<std::mutex> lock(heartbeatMutex);
+        const std::chrono::seconds interval(std::max(1u, m_leaseSeconds / 3));
+        while (!heartbeatStop.wait_for(lock, interval, [&converted] { return converted; }))
+        {
+            if (m_jobSeconds && std::chrono::steady_clock::now() - start >= std::chrono::seconds(m_jobSeconds))
+            {
+                m_jobsTimedOut++;
+                std::cerr << "Timed out converting " << jobName << "; no longer renewing its lease" << std::endl;
+                heartbeatStop.wait(lock, [&converted] { return converted; });
+                break;
+            }
+
+            std::error_code error;
+            fs::last_write_time(leasePath, fs::file_time_type::clock::now(), error);
+        }
+    });
+
+    CJobStats stats;
+    int exitCode = 1;
+    try
+    {
+        exitCode = convert(leasePath, tempResultPath.string(), stats);
+    }
+    catch (...)
+    {
+    }
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    {
+        std::lock_guard<std::mutex> lock(heartbeatMutex);
+        converted = true;
+    }
+    heartbeatStop.notify_all();
+    heartbeat.join();
+
+    // If this instance stalled for longer than the lease time, or the job ran past its time, another instance
+    // may have taken the job over
+    std::error_code error;
+    if (!fs::exists(leasePath, error))
+    {
+        fs::remove(tempResultPath, error);
+        std::cerr << "Lost the lease on " << jobName << std::endl;
+        return;
+    }
+
+    if (exitCode == 0)
+    {
+        fs::rename(tempResultPath, resultPath, error);
+    }
+    else
+    {
+        fs::remove(tempResultPath, error);
+    }
+
+    std::string statsJson = "{\n";
+    statsJson += "  \"job\": " + jsonString(jobName) + ",\n";
+    statsJson += "  \"owner\": " + jsonString(m_owner) + ",\n";
+    statsJson += "  \"exitCode\": " + std::to_string(exitCode) + ",\n";
+    statsJson += "  \"seconds\": " + std::to_string(seconds);
+    for (const auto& stat : stats)
+    {
+        statsJson += ",\n  " + jsonString(stat.first) + ": " + std::to_string(stat.second);
+    }
+    statsJson += "\n}\n";
+    writeFileAtomically(directory / (stem + statsSuffix), statsJson, m_owner);
+
+    // Finally mark the job finished, which releases the lease
+    fs::rename(leasePath, directory / (jobName + (exitCode == 0 ? doneExtension : failedExtension)), error);
+    if (error)
+    {
+        std::cerr << "Lost the lease on " << jobName << std::endl;
+        return;
+    }
+    if (exitCode == 0)
+    {
+        m_jobsDone++;
+    }
+    else
+    {
+        m_jobsFailed++;
+    }
+}
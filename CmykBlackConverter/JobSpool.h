@@ -0,0 +1,70 @@
+/* -----------------------------------------------------------------------
+ *  <copyright file="JobSpool.h" company="Global Graphics Software Ltd">
+ *      Copyright (c) 2023 Global Graphics Software Ltd. All rights reserved.
+ *  </copyright>
+ *  <summary>
+ *  This example is provided on an "as is" basis and without warranty of any kind.
+ *  Global Graphics Software Ltd. does not warrant or make any representations regarding the use or
+ *  results of use of this example.
+ *  </summary>
+ * -----------------------------------------------------------------------
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+// A directory of jobs shared by any number of converter instances, on any number of machines sharing the
+// file system. Each PDF file put in the directory is a job. An instance claims a job by renaming it to a lease
+// name that carries the instance's identity, which only one instance can do. While it converts the job it
+// keeps touching the lease; a lease left untouched for longer than the lease time belongs to an instance that
+// has died, and is renamed back so that the job is converted again, as "name.pdf.attempt<N>". After a few
+// attempts the job is marked failed instead, as it is likely to be what brought those instances down. With a
+// job timeout, the lease is no longer touched once a job has run for that long, so that a conversion hung
+// inside the SDK is recovered in the same way as one whose instance has died.
+// Leases are touched and checked with the local clock of each machine, so the machines' clocks must agree to
+// well within the lease time (keep them synchronised with NTP, for instance).
+//
+// For a job "name.pdf", the result is written next to it as "name.result.pdf" (or "name.result.json" for an
+// analysis), with statistics in "name.stats.json", and the job file itself is then renamed "name.pdf.done",
+// or "name.pdf.failed". The results are complete once the job has been renamed.
+class CJobSpool
+{
+public:
+    // Named figures reported in a job's statistics
+    typedef std::vector<std::pair<std::string, double>> CJobStats;
+
+    // Converts inputFile to outputFile, filling in stats, and returns the exit code
+    typedef std::function<int(const std::string& inputFile, const std::string& outputFile, CJobStats& stats)> CJobFunction;
+
+    // Zero job seconds means no limit
+    CJobSpool(const std::string& directory, const std::string& resultExtension, uint32_t leaseSeconds, uint32_t jobSeconds);
+
+    // Convert jobs until there are none left (if drain), or forever
+    void run(const CJobFunction& convert, bool drain);
+
+    uint32_t getJobsDone() const { return m_jobsDone; }
+    uint32_t getJobsFailed() const { return m_jobsFailed; }
+    uint32_t getLeasesRecovered() const { return m_leasesRecovered; }
+    uint32_t getJobsTimedOut() const { return m_jobsTimedOut; }
+
+private:
+    bool claim(std::string& jobName, std::string& leasePath);
+    void recoverStaleLeases();
+    void runJob(const CJobFunction& convert, const std::string& jobName, const std::string& leasePath);
+
+    const std::string m_directory;
+    const std::string m_resultExtension;
+    const uint32_t m_leaseSeconds;
+    const uint32_t m_jobSeconds;
+    std::string m_owner;            // This instance: host name and process id
+
+    uint32_t m_jobsDone;
+    uint32_t m_jobsFailed;
+    uint32_t m_leasesRecovered;
+    uint32_t m_jobsTimedOut;
+};
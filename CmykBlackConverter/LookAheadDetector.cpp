@@ -0,0 +1,199 @@
+/* -----------------------------------------------------------------------
+ *  <copyright file="LookAheadDetector.cpp" company="Global Graphics Software Ltd">
+ *      Copyright (c) 2023 Global Graphics Software Ltd. All rights reserved.
+ *  </copyright>
+ *  <summary>
+ *  This example is provided on an "as is" basis and without warranty of any kind.
+ *  Global Graphics Software Ltd. does not warrant or make any representations regarding the use or
+ *  results of use of this example.
+ *  </summary>
+ * -----------------------------------------------------------------------
+ */
+
+#include "LookAheadDetector.h"
+
+#include <jawsmako/customtransform.h>
+
+// A document whose pages are being checked
+struct CLookAheadDetector::CDocument
+{
+    std::vector<IPagePtr> pages;
+    const CCmykBlackConverterImplementation* converter;
+    std::vector<bool> started;      // Pages whose transform has started
+    size_t numStarted;
+    size_t next;                    // Pages before this have been checked or started
+};
+
+// Walks a page without changing it, handing each image to the converter to check. These are the images
+// the page cost estimator counts.
+class CLookAheadWalker : public ICustomTransform::IImplementation
+{
+public:
+    explicit CLookAheadWalker(const CCmykBlackConverterImplementation* converter) :
+        m_converter(converter)
+    {
+    }
+
+    IDOMNodePtr transformGlyphs(IImplementation* genericImplementation, const IDOMGlyphsPtr& glyphs, bool& changed, const CTransformState& state) override
+    {
+        detectBrush(glyphs->getFill());
+
+        bool didSomething = false;
+        genericImplementation->transformGlyphs(NULL, glyphs, didSomething, state);
+        return glyphs;
+    }
+
+    IDOMNodePtr transformPath(IImplementation* genericImplementation, const IDOMPathNodePtr& path, bool& changed, const CTransformState& state) override
+    {
+        detectBrush(path->getFill());
+        detectBrush(path->getStroke());
+
+        bool didSomething = false;
+        genericImplementation->transformPath(NULL, path, didSomething, state);
+        return path;
+    }
+
+private:
+    void detectBrush(const IDOMBrushPtr& brush)
+    {
+        if (!brush)
+        {
+            return;
+        }
+
+        if (brush->getBrushType() == IDOMBrush::eMasked)
+        {
+            detectBrush(edlobj2IDOMMaskedBrush(brush)->getBrush());
+        }
+        else if (brush->getBrushType() == IDOMBrush::eImage)
+        {
+            m_converter->detectImageAhead(edlobj2IDOMImageBrush(brush)->getImageSource());
+        }
+    }
+
+    const CCmykBlackConverterImplementation* m_converter;
+};
+
+CLookAheadDetector::CLookAheadDetector(const IJawsMakoPtr& jawsMako, CWorkStealingPool& pool, uint32 depth) :
+    m_jawsMako(jawsMako), m_pool(pool), m_depth(depth), m_current(nullptr), m_currentPosition(0), m_stopping(false),
+    m_thread(&CLookAheadDetector::run, this)
+{
+}
+
+CLookAheadDetector::~CLookAheadDetector()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_changed.notify_all();
+    m_thread.join();
+}
+
+CLookAheadDetector::CDocumentPtr CLookAheadDetector::addDocument(const std::vector<IPagePtr>& pages, const CCmykBlackConverterImplementation* converter)
+{
+    CDocumentPtr document = std::make_shared<CDocument>();
+    document->pages = pages;
+    document->converter = converter;
+    document->started.resize(pages.size(), false);
+    document->numStarted = 0;
+    document->next = 0;
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_documents.push_back(document);
+    }
+    m_changed.notify_all();
+    return document;
+}
+
+bool CLookAheadDetector::startPage(const CDocumentPtr& document, size_t position, CWorkStealingPool::CTask transform)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!document->started[position])
+    {
+        // The detector may go further ahead now
+        document->started[position] = true;
+        document->numStarted++;
+        m_changed.notify_all();
+    }
+
+    if (m_current != document.get() || m_currentPosition != position)
+    {
+        return true;
+    }
+
+    // Reserved now, so that the pool does not run dry while the transform is put off
+    m_pool.reserve();
+    m_currentTransform = std::move(transform);
+    return false;
+}
+
+void CLookAheadDetector::removeDocument(const CDocumentPtr& document)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_documents.remove(document);
+    m_changed.wait(lock, [&] { return m_current != document.get(); });
+}
+
+void CLookAheadDetector::run()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for (;;)
+    {
+        CDocumentPtr document;
+        size_t position = 0;
+        m_changed.wait(lock, [&] { return m_stopping || takePage(document, position); });
+        if (m_stopping)
+        {
+            return;
+        }
+
+        lock.unlock();
+        detectPage(*document, position);
+        lock.lock();
+
+        m_current = nullptr;
+        if (m_currentTransform)
+        {
+            m_pool.submitReserved(std::move(m_currentTransform));
+            m_currentTransform = nullptr;
+        }
+        m_changed.notify_all();
+    }
+}
+
+// Find the next page to check, in the earliest document that has one within reach, and mark it as current
+bool CLookAheadDetector::takePage(CDocumentPtr& document, size_t& position)
+{
+    for (const CDocumentPtr& candidate : m_documents)
+    {
+        while (candidate->next < candidate->pages.size() && candidate->started[candidate->next])
+        {
+            candidate->next++;
+        }
+        if (candidate->next < candidate->pages.size() && candidate->next < candidate->numStarted + m_depth)
+        {
+            document = candidate;
+            position = candidate->next++;
+            m_current = candidate.get();
+            m_currentPosition = position;
+            return true;
+        }
+    }
+    return false;
+}
+
+void CLookAheadDetector::detectPage(const CDocument& document, size_t position)
+{
+    // Any error is left for the transform of the page to meet
+    try
+    {
+        CLookAheadWalker walker(document.converter);
+        ICustomTransformPtr transform = ICustomTransform::create(m_jawsMako, &walker);
+        transform->transformPage(document.pages[position]);
+    }
+    catch (...)
+    {
+    }
+}
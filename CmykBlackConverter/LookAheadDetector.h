@@ -0,0 +1,80 @@
+/* -----------------------------------------------------------------------
+ *  <copyright file="LookAheadDetector.h" company="Global Graphics Software Ltd">
+ *      Copyright (c) 2023 Global Graphics Software Ltd. All rights reserved.
+ *  </copyright>
+ *  <summary>
+ *  This example is provided on an "as is" basis and without warranty of any kind.
+ *  Global Graphics Software Ltd. does not warrant or make any representations regarding the use or
+ *  results of use of this example.
+ *  </summary>
+ * -----------------------------------------------------------------------
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <jawsmako/jawsmako.h>
+
+#include "CmykBlackConverter.h"
+#include "TaskScheduler.h"
+
+using namespace JawsMako;
+
+// Runs the rich black detection pass on the CMYK images of upcoming pages, on a background thread of its own,
+// so that reading the images (from slow storage, say) and checking them overlaps with the transform of the
+// pages before. Pages themselves are not loaded ahead; they have been parsed already, as their cost was
+// estimated. The detection results, including the rows with full K, are kept by each document's converter
+// for its transform to use; a clean image is then not decoded by the transform at all, but an image with rich
+// black is still decoded again to convert it. Documents' pages are checked in the order they will be
+// transformed, up to a number of pages ahead of the last page whose transform has started.
+//
+// A page is never checked while it is being transformed. A page whose transform has started is not checked,
+// and the transform of a page that is being checked is put off, rather than holding a pool thread, and
+// submitted to the pool once the check is done.
+class CLookAheadDetector
+{
+public:
+    struct CDocument;
+    typedef std::shared_ptr<CDocument> CDocumentPtr;
+
+    CLookAheadDetector(const IJawsMakoPtr& jawsMako, CWorkStealingPool& pool, uint32 depth);
+    ~CLookAheadDetector();
+
+    CLookAheadDetector(const CLookAheadDetector&) = delete;
+    CLookAheadDetector& operator=(const CLookAheadDetector&) = delete;
+
+    // Start checking a document's pages, given in the order they will be transformed
+    CDocumentPtr addDocument(const std::vector<IPagePtr>& pages, const CCmykBlackConverterImplementation* converter);
+
+    // The transform of the page at this position is about to start. Returns false if the page is being
+    // checked, in which case transform is submitted to the pool once it has been, to start again.
+    bool startPage(const CDocumentPtr& document, size_t position, CWorkStealingPool::CTask transform);
+
+    // Stop checking a document, waiting for any page of it being checked
+    void removeDocument(const CDocumentPtr& document);
+
+private:
+    void run();
+    bool takePage(CDocumentPtr& document, size_t& position);
+    void detectPage(const CDocument& document, size_t position);
+
+    const IJawsMakoPtr m_jawsMako;
+    CWorkStealingPool& m_pool;
+    const uint32 m_depth;
+
+    std::mutex m_mutex;
+    std::condition_variable m_changed;
+    std::list<CDocumentPtr> m_documents;    // In the order they were added
+    const CDocument* m_current;             // The document with a page being checked, if any
+    size_t m_currentPosition;
+    CWorkStealingPool::CTask m_currentTransform;    // Put off until the current page is checked, if any
+    bool m_stopping;
+
+    std::thread m_thread;                   // Last, so that it starts with everything else in place
+};
@@ -10,8 +10,18 @@
  * -----------------------------------------------------------------------
  */
 
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
 #include <iostream>
 #include <filesystem>
+#include <memory>
+#include <set>
+#include <sstream>
+#include <thread>
+#include <vector>
 
 #include <jawsmako/jawsmako.h>
 #include <edl/icolormanager.h>
@@ -19,13 +29,110 @@
 
 #include "cxxopts.hpp"
 
+#include "BatchConverter.h"
 #include "CmykBlackConverter.h"
+#include "JobSpool.h"
+#include "MemoryStreams.h"
+#include "ResultCache.h"
+#include "WorkerPool.h"
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
 
 namespace fs = std::filesystem;
 
 using namespace JawsMako;
 using namespace EDL;
 
+// Everything that determines the output for a given input, for the result cache key: the version of the
+// conversion, the version of the SDK that writes the output, and the options
+static std::string cacheSettings(const CCmykBlackConverterOptions& options)
+{
+    const IJawsMako::CMakoVersion makoVersion = IJawsMako::getMakoVersion();
+    std::ostringstream settings;
+    settings << "CmykBlackConverter " << CMYK_BLACK_CONVERTER_OUTPUT_VERSION
+             << " mako=" << makoVersion.majorVersion << "." << makoVersion.minorVersion
+             << "." << makoVersion.revisionNumber << "." << makoVersion.buildNumber
+             << " devicen=" << options.useDeviceN
+             << " nooverprint=" << options.doNotApplyOverprint
+             << " encoding=" << options.imageEncoding
+             << " quality=" << static_cast<int>(options.jpegQuality)
+             << " maxImageMemory=" << options.maxImageMemory;
+    return settings.str();
+}
+
+// The file name that stands for standard input or output
+static const std::string standardStream = "-";
+
+// Read standard input directly, without stdio buffering in between
+static int64 readStandardInput(void* buffer, size_t length)
+{
+#ifdef _WIN32
+    return _read(_fileno(stdin), buffer, static_cast<unsigned int>(std::min<size_t>(length, INT_MAX)));
+#else
+    ssize_t count;
+    do
+        count = read(STDIN_FILENO, buffer, length);
+    while (count < 0 && errno == EINTR);
+    return count;
+#endif
+}
+
+// Pass each chunk on straight away, so that the next program in the pipeline can start on it
+static bool writeStandardOutput(const void* data, size_t length)
+{
+    return fwrite(data, 1, length, stdout) == length && fflush(stdout) == 0;
+}
+
+static std::string lowerCase(std::string text)
+{
+    std::transform(text.begin(), text.end(), text.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+    return text;
+}
+
+static IJawsMakoPtr createJawsMako()
+{
+    const IJawsMakoPtr jawsMako = IJawsMako::create();
+    IJawsMako::enablePDFInput(jawsMako);
+    IJawsMako::enablePDFOutput(jawsMako);
+    return jawsMako;
+}
+
+// Convert a single document in this process, as a worker process or spool job does, optionally returning its statistics
+static int convertDocument(const IJawsMakoPtr& jawsMako, const CCmykBlackConverterOptions& converterOptions, uint32 numThreads,
+                           bool mapInput, uint32 detectAheadDepth, CResultCache* cache, const std::string& inputFile,
+                           const std::string& outputFile, CJobSpool::CJobStats* jobStats = nullptr)
+{
+    CBatchConverter converter(jawsMako, converterOptions, numThreads, 0);
+    converter.setMapInput(mapInput);
+    converter.setDetectAheadDepth(detectAheadDepth);
+    if (cache)
+        converter.setResultCache(cache, cacheSettings(converterOptions));
+    converter.add(inputFile, outputFile);
+    const int exitCode = converter.finish();
+
+    if (jobStats)
+    {
+        const CTransformStats stats = converter.getStats();
+        *jobStats = {
+            { "nodesVisited", static_cast<double>(stats.nodesVisited) },
+            { "genericDescents", static_cast<double>(stats.genericDescents) },
+            { "genericDescentsSkipped", static_cast<double>(stats.genericDescentsSkipped) },
+            { "imagesFromIndex", static_cast<double>(stats.imagesFromIndex) },
+            { "imagesDetectedAhead", static_cast<double>(stats.imagesDetectedAhead) },
+            { "resultCacheHits", static_cast<double>(converter.getCacheHits()) },
+            { "threads", static_cast<double>(converter.numThreads()) },
+            { "pageTransformSeconds", converter.getTransformSeconds() },
+            { "pageCostEstimateError", converter.getEstimateError() }
+        };
+    }
+    return exitCode;
+}
+
 int main(int argc, char* argv[])
 {
     try
@@ -33,61 +140,243 @@ int main(int argc, char* argv[])
         // Deal with program options
         cxxopts::Options options("CmykBlackConverter", "Convert rich black to K-only black\n");
         options
-            .positional_help("<input file> [<output file>]")
+            .positional_help("<input file> [<output file>] | <input file>... -O <output directory>")
             .set_width(70)
             .add_options()
             ("infile", "Input file", cxxopts::value<std::string>())
             ("outfile", "Output file", cxxopts::value<std::string>()->default_value("*"))
+            ("morefiles", "More input files", cxxopts::value<std::vector<std::string>>())
+            ("O,output-dir", "Convert every input file given, writing the results to this directory", cxxopts::value<std::string>())
             ("d,devicen", "Use a DeviceN (spot) colour black, instead of a DeviceCMYK black")
             ("o,overprint", "Do *not* set overprint on changed objects")
+            ("a,analyze", "Report rich black objects as JSON instead of converting")
+            ("e,image-encoding", "Encoding of converted images: auto, raw or dct", cxxopts::value<std::string>()->default_value("auto"))
+            ("q,jpeg-quality", "Quality (1-100) when DCT encoding converted images; 0 matches the source", cxxopts::value<int>()->default_value("0"))
+            ("m,max-image-memory", "Hold converted images larger than this many MB in a temporary file; 0 for no limit", cxxopts::value<uint32>()->default_value("0"))
+            ("i,image-index", "Remember which images contain rich black in this index file, across runs", cxxopts::value<std::string>())
+            ("c,cache-dir", "Reuse results of earlier runs from this cache directory", cxxopts::value<std::string>())
+            ("cache-size", "Limit the cache to this many MB; 0 for no limit", cxxopts::value<uint32>()->default_value("1024"))
+            ("t,threads", "Convert on this many threads; 0 for one per core", cxxopts::value<uint32>()->default_value("0"))
+            ("max-in-flight", "Limit the documents converted at once to this many MB of input; 0 for no limit", cxxopts::value<uint32>()->default_value("1024"))
+            ("map-input", "Read input files through a memory mapping, without copying them")
+            ("detect-ahead", "Check the images on this many pages ahead of those being converted for rich black, on a thread of its own; 0 for none", cxxopts::value<uint32>()->default_value("0"))
+            ("w,workers", "Convert in this many worker processes, so that a crash affects only the document being converted; 0 to convert in this process", cxxopts::value<uint32>()->default_value("0"))
+            ("worker-jobs", "Replace each worker process after this many documents; 0 for never", cxxopts::value<uint32>()->default_value("100"))
+            ("timeout", "Stop a worker process, or give up a spool job, that takes longer than this many seconds over a document; 0 for no limit", cxxopts::value<uint32>()->default_value("0"))
+            ("S,spool", "Convert the jobs put in this directory, which other instances may share", cxxopts::value<std::string>())
+            ("lease", "Take over a spool job whose instance has not renewed its lease for this many seconds", cxxopts::value<uint32>()->default_value("300"))
+            ("drain", "Stop when the spool has no more jobs, instead of waiting for more")
+            ("s,stats", "Report transform statistics on stderr")
             ("h,help", "Show this Usage information");
+        options.add_options("internal")
+            (CWorkerProcessPool::workerOption, "Run as a worker process", cxxopts::value<std::string>());
 
-        options.parse_positional({ "infile", "outfile" });
+        options.parse_positional({ "infile", "outfile", "morefiles" });
 
         const auto result = options.parse(argc, argv);
 
         if (result.count("help"))
         {
-            std::cout << options.help() << std::endl;
+            std::cout << options.help({ "" }) << std::endl;
             return 0;
         }
 
-        const U8String inputFile = result["infile"].as<std::string>().c_str();
-        if (!fs::exists(inputFile))
-            throw std::invalid_argument(std::string("Input file not found."));
+        CCmykBlackConverterOptions converterOptions;
+        converterOptions.analyzeOnly = result["analyze"].as<bool>();
+        const bool analyzeOnly = converterOptions.analyzeOnly;
 
-        U8String outputFile = result["outfile"].as<std::string>().c_str();
-        if (outputFile == "*")
-            outputFile = (fs::path(inputFile).remove_filename().string() + fs::path(inputFile).stem().string() + "_out.pdf").c_str();
+        converterOptions.useDeviceN = result["devicen"].as<bool>();
+        converterOptions.doNotApplyOverprint = result["overprint"].as<bool>();
 
-        const bool useDeviceN = result["devicen"].as<bool>();
-        const bool doNotApplyOverprint = result["overprint"].as<bool>();
+        const std::string encodingName = result["image-encoding"].as<std::string>();
+        if (encodingName == "auto")
+            converterOptions.imageEncoding = eIEAuto;
+        else if (encodingName == "raw")
+            converterOptions.imageEncoding = eIERaw;
+        else if (encodingName == "dct")
+            converterOptions.imageEncoding = eIEDCT;
+        else
+            throw std::invalid_argument(std::string("Unknown image encoding: ") + encodingName);
 
-        // Create our JawsMako instance.
-        const IJawsMakoPtr jawsMako = IJawsMako::create();
-        IJawsMako::enablePDFInput(jawsMako);
-        IJawsMako::enablePDFOutput(jawsMako);
+        const int jpegQuality = result["jpeg-quality"].as<int>();
+        if (jpegQuality < 0 || jpegQuality > 100)
+            throw std::invalid_argument(std::string("JPEG quality must be between 0 and 100."));
+        converterOptions.jpegQuality = static_cast<uint8>(jpegQuality);
+        if (result.count("image-index"))
+            converterOptions.imageIndex = result["image-index"].as<std::string>();
+        converterOptions.maxImageMemory = static_cast<uint64>(result["max-image-memory"].as<uint32>()) * 1024 * 1024;
 
-        // Create our input
-        const IInputPtr input = IInput::create(jawsMako, eFFPDF);
-        const IOutputPtr output = IOutput::create(jawsMako, eFFPDF);
+        std::unique_ptr<CResultCache> cache;
+        if (result.count("cache-dir") && !analyzeOnly)
+            cache.reset(new CResultCache(result["cache-dir"].as<std::string>(), static_cast<uint64_t>(result["cache-size"].as<uint32>()) * 1024 * 1024));
 
-        const IDocumentAssemblyPtr assembly = input->open(inputFile);
-        const IDocumentPtr document = assembly->getDocument();
+        const bool mapInput = result["map-input"].as<bool>();
+        const uint32 detectAheadDepth = result["detect-ahead"].as<uint32>();
 
-        // Choose the color converter. This is a custom transform implementation, so
-		// it needs to be wrapped in an ICustomTransform to be used.
-        CCmykBlackConverterImplementation cmykBlackConverter(jawsMako, useDeviceN, doNotApplyOverprint);
-        ICustomTransformPtr colorTransform = ICustomTransform::create(jawsMako, &cmykBlackConverter);
+        // Worker processes share the cores between them
+        const uint32 numWorkers = result["workers"].as<uint32>();
+        uint32 numThreads = result["threads"].as<uint32>();
+        if (numWorkers && !numThreads)
+            numThreads = std::max(1u, std::thread::hardware_concurrency() / numWorkers);
+
+        if (result.count(CWorkerProcessPool::workerOption))
+        {
+            // A worker process converts the documents its pool sends it, one at a time
+            const IJawsMakoPtr jawsMako = createJawsMako();
+            return CWorkerProcessPool::runWorker(result[CWorkerProcessPool::workerOption].as<std::string>(),
+                [&](const std::string& inputFile, const std::string& outputFile)
+                {
+                    return convertDocument(jawsMako, converterOptions, numThreads, mapInput, detectAheadDepth, cache.get(), inputFile, outputFile);
+                });
+        }
+
+        if (result.count("spool"))
+        {
+            if (numWorkers)
+                throw std::invalid_argument(std::string("A spool is not run with worker processes; run more instances instead."));
+
+            // Take jobs from the spool directory, alongside any other instances using it
+            const IJawsMakoPtr jawsMako = createJawsMako();
+            CJobSpool spool(result["spool"].as<std::string>(), analyzeOnly ? ".json" : ".pdf", result["lease"].as<uint32>(), result["timeout"].as<uint32>());
+            spool.run([&](const std::string& inputFile, const std::string& outputFile, CJobSpool::CJobStats& stats)
+                {
+                    return convertDocument(jawsMako, converterOptions, numThreads, mapInput, detectAheadDepth, cache.get(), inputFile, outputFile, &stats);
+                },
+                result["drain"].as<bool>());
+
+            if (result["stats"].as<bool>())
+            {
+                std::cerr << "Spool jobs done: " << spool.getJobsDone() << std::endl;
+                std::cerr << "Spool jobs failed: " << spool.getJobsFailed() << std::endl;
+                std::cerr << "Stale leases recovered: " << spool.getLeasesRecovered() << std::endl;
+                std::cerr << "Spool jobs timed out: " << spool.getJobsTimedOut() << std::endl;
+            }
+            return 0;
+        }
+
+        // The documents to convert, and where their results go
+        std::vector<std::pair<std::string, std::string>> documents;
+        if (result.count("output-dir"))
+        {
+            const fs::path outputDir = result["output-dir"].as<std::string>();
+            fs::create_directories(outputDir);
+
+            std::vector<std::string> inputFiles = { result["infile"].as<std::string>() };
+            if (result["outfile"].as<std::string>() != "*")
+                inputFiles.push_back(result["outfile"].as<std::string>());
+            if (result.count("morefiles"))
+            {
+                const auto& moreFiles = result["morefiles"].as<std::vector<std::string>>();
+                inputFiles.insert(inputFiles.end(), moreFiles.begin(), moreFiles.end());
+            }
+            // Inputs of the same name, from different directories, are numbered so that each has a result of its own.
+            // Names are compared ignoring case, as the file system may.
+            const std::string suffix = analyzeOnly ? ".json" : "_out.pdf";
+            std::set<std::string> outputNames;
+            for (const std::string& inputFile : inputFiles)
+            {
+                const std::string stem = fs::path(inputFile).stem().string();
+                std::string outputName = stem + suffix;
+                for (uint32 number = 2; !outputNames.insert(lowerCase(outputName)).second; number++)
+                    outputName = stem + "_" + std::to_string(number) + suffix;
+                documents.emplace_back(inputFile, (outputDir / outputName).string());
+            }
+        }
+        else
+        {
+            if (result.count("morefiles"))
+                throw std::invalid_argument(std::string("Give an output directory to convert more than one file."));
+
+            const std::string inputFile = result["infile"].as<std::string>();
+            std::string outputFile = result["outfile"].as<std::string>();
+            if (analyzeOnly && outputFile == standardStream)
+                outputFile = "*";
+            else if (outputFile == "*" && !analyzeOnly)
+                outputFile = inputFile == standardStream ? standardStream
+                                                         : fs::path(inputFile).remove_filename().string() + fs::path(inputFile).stem().string() + "_out.pdf";
+            documents.emplace_back(inputFile, outputFile);
+        }
+
+        bool usesStandardStreams = false;
+        for (const auto& document : documents)
+        {
+            usesStandardStreams |= document.first == standardStream || document.second == standardStream;
+            if (document.first != standardStream && !fs::exists(document.first))
+                throw std::invalid_argument(std::string("Input file not found: ") + document.first);
+        }
+        if (usesStandardStreams && (documents.size() > 1 || numWorkers))
+            throw std::invalid_argument(std::string("Standard input and output are only used converting a single document in this process."));
+
+        if (numWorkers)
+        {
+            CWorkerProcessPool workers(argc, argv, numWorkers, result["worker-jobs"].as<uint32>(), result["timeout"].as<uint32>());
+            for (const auto& document : documents)
+                workers.add(document.first, document.second);
+            const int exitCode = workers.finish();
+
+            if (result["stats"].as<bool>())
+            {
+                std::cerr << "Worker processes: " << numWorkers << " (" << numThreads << " threads each)" << std::endl;
+                std::cerr << "Worker crashes: " << workers.getCrashes() << std::endl;
+                std::cerr << "Worker timeouts: " << workers.getTimeouts() << std::endl;
+                std::cerr << "Worker restarts: " << workers.getRestarts() << std::endl;
+            }
+            return exitCode;
+        }
+
+        // Create our JawsMako instance.
+        const IJawsMakoPtr jawsMako = createJawsMako();
+
+        // Convert the documents on a pool of threads. Each document's pages are transformed by its own color
+        // converter, a custom transform implementation that the converter wraps in an ICustomTransform.
+        CBatchConverter converter(jawsMako, converterOptions, numThreads,
+                                  static_cast<uint64>(result["max-in-flight"].as<uint32>()) * 1024 * 1024);
+        if (cache)
+            converter.setResultCache(cache.get(), cacheSettings(converterOptions));
+        converter.setMapInput(mapInput);
+        converter.setDetectAheadDepth(detectAheadDepth);
+
+        for (const auto& document : documents)
+        {
+            // Standard input is read into memory, as the PDF input needs to seek about it. Standard output is
+            // written as the document is, rather than when it is complete.
+            IRAInputStreamPtr inputStream;
+            IOutputStreamPtr outputStream;
+            if (document.first == standardStream)
+            {
+#ifdef _WIN32
+                _setmode(_fileno(stdin), _O_BINARY);
+#endif
+                inputStream = createReadInputStream(readStandardInput);
+            }
+            if (document.second == standardStream)
+            {
+#ifdef _WIN32
+                _setmode(_fileno(stdout), _O_BINARY);
+#endif
+                outputStream = createCallbackOutputStream(writeStandardOutput);
+            }
+            converter.add(document.first, document.second, inputStream, outputStream);
+        }
+        const int exitCode = converter.finish();
 
-        for (uint32 pageIndex = 0; pageIndex < document->getNumPages(); pageIndex++)
+        if (result["stats"].as<bool>())
         {
-            // Get page
-            IPagePtr page = document->getPage(pageIndex);
-            colorTransform->transformPage(page);
+            const CTransformStats stats = converter.getStats();
+            std::cerr << "Nodes visited: " << stats.nodesVisited << std::endl;
+            std::cerr << "Generic descents: " << stats.genericDescents
+                      << " (" << stats.genericDescentsSkipped << " skipped for leaf brushes)" << std::endl;
+            std::cerr << "Images found in the image index: " << stats.imagesFromIndex << std::endl;
+            if (detectAheadDepth)
+                std::cerr << "Images checked ahead: " << stats.imagesDetectedAhead << std::endl;
+            if (cache)
+                std::cerr << "Result cache hits: " << converter.getCacheHits() << std::endl;
+            std::cerr << "Threads: " << converter.numThreads() << std::endl;
+            std::cerr << "Page transform time: " << converter.getTransformSeconds() << "s" << std::endl;
+            std::cerr << "Page cost estimate error: " << static_cast<int>(converter.getEstimateError() * 100.0 + 0.5) << "%" << std::endl;
         }
 
-        output->writeAssembly(assembly, outputFile);
+        return exitCode;
     }
     catch (IError& e)
     {
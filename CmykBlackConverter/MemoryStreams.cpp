@@ -0,0 +1,426 @@
+/* -----------------------------------------------------------------------
+ *  <copyright file="MemoryStreams.cpp" company="Global Graphics Software Ltd">
+ *      Copyright (c) 2023 Global Graphics Software Ltd. All rights reserved.
+ *  </copyright>
+ *  <summary>
+ *  This example is provided on an "as is" basis and without warranty of any kind.
+ *  Global Graphics Software Ltd. does not warrant or make any representations regarding the use or
+ *  results of use of this example.
+ *  </summary>
+ * -----------------------------------------------------------------------
+ */
+
+#include "MemoryStreams.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <io.h>
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace fs = std::filesystem;
+
+// A document read through a function is held in chunks of this size
+static const size_t readChunkBytes = 4 * 1024 * 1024;
+
+// A read-only stream over a document in memory
+class CMemoryInputStream : public IRAInputStream
+{
+public:
+    CMemoryInputStream(const uint8* data, size_t size) :
+        m_data(data), m_size(size), m_position(0)
+    {
+    }
+
+    bool open() override
+    {
+        m_position = 0;
+        return true;
+    }
+
+    void close() override
+    {
+    }
+
+    int32 read(void* buffer, int32 length) override
+    {
+        const size_t count = std::min<size_t>(length, m_size - m_position);
+        if (count)
+        {
+            memcpy(buffer, m_data + m_position, count);
+            m_position += count;
+        }
+        return (int32) count;
+    }
+
+    bool seek(int64 position) override
+    {
+        if (position < 0 || (uint64) position > m_size)
+        {
+            return false;
+        }
+        m_position = (size_t) position;
+        return true;
+    }
+
+    int64 tell() override
+    {
+        return (int64) m_position;
+    }
+
+    int64 length() override
+    {
+        return (int64) m_size;
+    }
+
+private:
+    const uint8* m_data;
+    size_t m_size;
+    size_t m_position;
+};
+
+// A memory stream that holds on to the file mapping it reads
+class CMappedInputStream : public CMemoryInputStream
+{
+public:
+    explicit CMappedInputStream(const CFileMappingPtr& mapping) :
+        CMemoryInputStream(mapping->data(), mapping->size()), m_mapping(mapping)
+    {
+    }
+
+private:
+    CFileMappingPtr m_mapping;
+};
+
+// A read-only stream over a document held in equal sized chunks, all full but the last
+class CChunkedInputStream : public IRAInputStream
+{
+public:
+    CChunkedInputStream(std::vector<std::unique_ptr<uint8[]>>&& chunks, size_t size) :
+        m_chunks(std::move(chunks)), m_size(size), m_position(0)
+    {
+    }
+
+    bool open() override
+    {
+        m_position = 0;
+        return true;
+    }
+
+    void close() override
+    {
+    }
+
+    int32 read(void* buffer, int32 length) override
+    {
+        // Reads may straddle chunks
+        uint8* out = (uint8*) buffer;
+        size_t remaining = std::min<size_t>(length, m_size - m_position);
+        while (remaining)
+        {
+            const size_t offset = m_position % readChunkBytes;
+            const size_t count = std::min(remaining, readChunkBytes - offset);
+            memcpy(out, m_chunks[m_position / readChunkBytes].get() + offset, count);
+            out += count;
+            m_position += count;
+            remaining -= count;
+        }
+        return (int32) (out - (uint8*) buffer);
+    }
+
+    bool seek(int64 position) override
+    {
+        if (position < 0 || (uint64) position > m_size)
+        {
+            return false;
+        }
+        m_position = (size_t) position;
+        return true;
+    }
+
+    int64 tell() override
+    {
+        return (int64) m_position;
+    }
+
+    int64 length() override
+    {
+        return (int64) m_size;
+    }
+
+private:
+    std::vector<std::unique_ptr<uint8[]>> m_chunks;
+    size_t m_size;
+    size_t m_position;
+};
+
+// Gathers small writes into chunks for the write function. Once a write fails, so does everything after it.
+class CCallbackOutputStream : public IOutputStream
+{
+public:
+    CCallbackOutputStream(const CWriteFunction& write, size_t bufferBytes) :
+        m_write(write), m_bufferBytes(bufferBytes), m_failed(false)
+    {
+        m_buffer.reserve(bufferBytes);
+    }
+
+    bool open() override
+    {
+        return !m_failed;
+    }
+
+    void close() override
+    {
+        flush();
+    }
+
+    int32 write(const void* buffer, int32 length) override
+    {
+        if (m_failed || length < 0)
+        {
+            return -1;
+        }
+
+        const uint8* data = (const uint8*) buffer;
+        if (m_buffer.size() + length > m_bufferBytes)
+        {
+            if (!flush())
+            {
+                return -1;
+            }
+
+            // Large writes go straight through
+            if ((size_t) length >= m_bufferBytes)
+            {
+                if (!m_write(data, length))
+                {
+                    m_failed = true;
+                    return -1;
+                }
+                return length;
+            }
+        }
+        m_buffer.insert(m_buffer.end(), data, data + length);
+        return length;
+    }
+
+    bool flush() override
+    {
+        if (!m_failed && !m_buffer.empty())
+        {
+            m_failed = !m_write(m_buffer.data(), m_buffer.size());
+            m_buffer.clear();
+        }
+        return !m_failed;
+    }
+
+private:
+    CWriteFunction m_write;
+    size_t m_bufferBytes;
+    std::vector<uint8> m_buffer;
+    bool m_failed;
+};
+
+IRAInputStreamPtr createMemoryInputStream(const uint8* data, size_t size)
+{
+    return IRAInputStreamPtr(new CMemoryInputStream(data, size));
+}
+
+CFileMapping::CFileMapping(const std::string& path) :
+    m_stream(nullptr), m_data(nullptr), m_size(0)
+{
+#ifdef _WIN32
+    m_mapping = nullptr;
+    m_file = CreateFileW(fs::path(path).wstring().c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (m_file == INVALID_HANDLE_VALUE)
+    {
+        throwEDLError(JM_ERR_GENERAL, L"Unable to open the input file for mapping");
+    }
+    if (!map())
+    {
+        release();
+        throwEDLError(JM_ERR_GENERAL, L"Unable to map the input file");
+    }
+#else
+    const int file = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (file < 0)
+    {
+        throwEDLError(JM_ERR_GENERAL, L"Unable to open the input file for mapping");
+    }
+
+    // The mapping keeps the file open by itself
+    const bool mapped = map(file);
+    close(file);
+    if (!mapped)
+    {
+        throwEDLError(JM_ERR_GENERAL, L"Unable to map the input file");
+    }
+#endif
+}
+
+CFileMapping::CFileMapping(FILE* file) :
+    m_stream(file), m_data(nullptr), m_size(0)
+{
+#ifdef _WIN32
+    m_mapping = nullptr;
+    m_file = (HANDLE) _get_osfhandle(_fileno(file));
+    const bool mapped = m_file != INVALID_HANDLE_VALUE && map();
+#else
+    const bool mapped = map(fileno(file));
+#endif
+    if (!mapped)
+    {
+        release();
+        throwEDLError(JM_ERR_GENERAL, L"Unable to map the file");
+    }
+}
+
+CFileMapping::~CFileMapping()
+{
+    release();
+}
+
+#ifdef _WIN32
+bool CFileMapping::map()
+{
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(m_file, &size) || (uint64) size.QuadPart > SIZE_MAX)
+    {
+        return false;
+    }
+    m_size = (size_t) size.QuadPart;
+
+    // An empty file cannot be mapped, and needs no mapping
+    if (!m_size)
+    {
+        return true;
+    }
+    m_mapping = CreateFileMappingW(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (m_mapping)
+    {
+        m_data = (const uint8*) MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+    }
+    return m_data != nullptr;
+}
+#else
+bool CFileMapping::map(int file)
+{
+    struct stat status;
+    if (fstat(file, &status) != 0 || (uint64) status.st_size > SIZE_MAX)
+    {
+        return false;
+    }
+    m_size = (size_t) status.st_size;
+
+    // An empty file cannot be mapped, and needs no mapping
+    if (!m_size)
+    {
+        return true;
+    }
+    void* data = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, file, 0);
+    if (data == MAP_FAILED)
+    {
+        return false;
+    }
+    m_data = (const uint8*) data;
+    return true;
+}
+#endif
+
+void CFileMapping::release()
+{
+#ifdef _WIN32
+    if (m_data)
+    {
+        UnmapViewOfFile(m_data);
+    }
+    if (m_mapping)
+    {
+        CloseHandle(m_mapping);
+    }
+
+    // A file taken over is closed through its stream, which owns the handle
+    if (!m_stream && m_file != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(m_file);
+    }
+#else
+    if (m_data)
+    {
+        munmap((void*) m_data, m_size);
+    }
+#endif
+    if (m_stream)
+    {
+        fclose(m_stream);
+    }
+}
+
+// Windows has no hints for mapped views; the mapping alone saves the copies
+void CFileMapping::adviseSequential()
+{
+#ifndef _WIN32
+    if (m_data)
+    {
+        madvise((void*) m_data, m_size, MADV_SEQUENTIAL);
+    }
+#endif
+}
+
+void CFileMapping::adviseRandom()
+{
+#ifndef _WIN32
+    if (m_data)
+    {
+        madvise((void*) m_data, m_size, MADV_RANDOM);
+    }
+#endif
+}
+
+IRAInputStreamPtr createMappedInputStream(const CFileMappingPtr& mapping)
+{
+    return IRAInputStreamPtr(new CMappedInputStream(mapping));
+}
+
+IRAInputStreamPtr createReadInputStream(const CReadFunction& read)
+{
+    std::vector<std::unique_ptr<uint8[]>> chunks;
+    size_t size = 0;
+    for (;;)
+    {
+        const size_t offset = size % readChunkBytes;
+        if (offset == 0 && size / readChunkBytes == chunks.size())
+        {
+            chunks.emplace_back(new uint8[readChunkBytes]);
+        }
+        const int64 count = read(chunks.back().get() + offset, readChunkBytes - offset);
+        if (count < 0)
+        {
+            throwEDLError(JM_ERR_GENERAL, L"Unable to read the input stream");
+        }
+        if (count == 0)
+        {
+            break;
+        }
+        size += (size_t) count;
+    }
+    return IRAInputStreamPtr(new CChunkedInputStream(std::move(chunks), size));
+}
+
+IOutputStreamPtr createCallbackOutputStream(const CWriteFunction& write, size_t bufferBytes)
+{
+    return IOutputStreamPtr(new CCallbackOutputStream(write, bufferBytes));
+}
@@ -0,0 +1,84 @@
+/* -----------------------------------------------------------------------
+ *  <copyright file="MemoryStreams.h" company="Global Graphics Software Ltd">
+ *      Copyright (c) 2023 Global Graphics Software Ltd. All rights reserved.
+ *  </copyright>
+ *  <summary>
+ *  This example is provided on an "as is" basis and without warranty of any kind.
+ *  Global Graphics Software Ltd. does not warrant or make any representations regarding the use or
+ *  results of use of this example.
+ *  </summary>
+ * -----------------------------------------------------------------------
+ */
+
+#pragma once
+
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <string>
+
+#include <jawsmako/jawsmako.h>
+
+using namespace JawsMako;
+
+// Reads up to length bytes into buffer, returning the number read, 0 at the end, or less than 0 on error
+typedef std::function<int64(void* buffer, size_t length)> CReadFunction;
+
+// Writes all length bytes of data, returning false on error
+typedef std::function<bool(const void* data, size_t length)> CWriteFunction;
+
+// A stream over a document in memory, which the caller keeps in place until the stream is released. The PDF
+// input seeks about the document as it reads it, so it is given the data directly rather than a copy.
+IRAInputStreamPtr createMemoryInputStream(const uint8* data, size_t size);
+
+// A file mapped read-only into memory, so that reading it comes straight from the page cache without copies.
+// The hints tell the system how the mapping will be read next, to guide its read-ahead: sequentially as the
+// PDF input scans the cross reference table, then object by object in no particular order.
+class CFileMapping
+{
+public:
+    explicit CFileMapping(const std::string& path);
+
+    // Map a file already open for reading, such as a temporary file, taking it over: it is closed when the
+    // mapping is released
+    explicit CFileMapping(FILE* file);
+
+    ~CFileMapping();
+
+    CFileMapping(const CFileMapping&) = delete;
+    CFileMapping& operator=(const CFileMapping&) = delete;
+
+    const uint8* data() const { return m_data; }
+    size_t size() const { return m_size; }
+
+    void adviseSequential();
+    void adviseRandom();
+
+private:
+#ifdef _WIN32
+    bool map();
+#else
+    bool map(int file);
+#endif
+    void release();
+
+#ifdef _WIN32
+    void* m_file;
+    void* m_mapping;
+#endif
+    FILE* m_stream;     // The file taken over, if any
+    const uint8* m_data;
+    size_t m_size;
+};
+typedef std::shared_ptr<CFileMapping> CFileMappingPtr;
+
+// A stream over a mapped file, which keeps the mapping for as long as it is used
+IRAInputStreamPtr createMappedInputStream(const CFileMappingPtr& mapping);
+
+// Read a whole document through read into memory, returning a stream over it. The document is read straight
+// into fixed size chunks, so that each byte is copied once however large it turns out to be, which suits a
+// pipe whose length is not known up front. Throws if read fails.
+IRAInputStreamPtr createReadInputStream(const CReadFunction& read);
+
+// A stream that passes everything written to write, in chunks of up to bufferBytes
+IOutputStreamPtr createCallbackOutputStream(const CWriteFunction& write, size_t bufferBytes = 64 * 1024);
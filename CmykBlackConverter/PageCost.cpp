@@ -0,0 +1,83 @@
+/* -----------------------------------------------------------------------
+ *  <copyright file="PageCost.cpp" company="Global Graphics Software Ltd">
+ *      Copyright (c) 2023 Global Graphics Software Ltd. All rights reserved.
+ *  </copyright>
+ *  <summary>
+ *  This example is provided on an "as is" basis and without warranty of any kind.
+ *  Global Graphics Software Ltd. does not warrant or make any representations regarding the use or
+ *  results of use of this example.
+ *  </summary>
+ * -----------------------------------------------------------------------
+ */
+
+#include "PageCost.h"
+
+// A node costs about as much as this many bytes of image data
+static const uint64 nodeCost = 2048;
+
+CPageCostEstimator::CPageCostEstimator(const IJawsMakoPtr& jawsMako) :
+    m_jawsMako(jawsMako), m_nodes(0), m_imageBytes(0)
+{
+}
+
+uint64 CPageCostEstimator::estimate(const IPagePtr& page)
+{
+    m_nodes = 0;
+    m_imageBytes = 0;
+
+    ICustomTransformPtr walker = ICustomTransform::create(m_jawsMako, this);
+    walker->transformPage(page);
+
+    return m_nodes * nodeCost + m_imageBytes;
+}
+
+IDOMNodePtr CPageCostEstimator::transformGlyphs(IImplementation* genericImplementation, const IDOMGlyphsPtr& glyphs, bool& changed, const CTransformState& state)
+{
+    m_nodes++;
+    addBrush(glyphs->getFill());
+
+    bool didSomething = false;
+    genericImplementation->transformGlyphs(NULL, glyphs, didSomething, state);
+    return glyphs;
+}
+
+IDOMNodePtr CPageCostEstimator::transformPath(IImplementation* genericImplementation, const IDOMPathNodePtr& path, bool& changed, const CTransformState& state)
+{
+    m_nodes++;
+    addBrush(path->getFill());
+    addBrush(path->getStroke());
+
+    bool didSomething = false;
+    genericImplementation->transformPath(NULL, path, didSomething, state);
+    return path;
+}
+
+// Images are where the time goes. Only CMYK images are decoded by the converter; indexed images only
+// have their palette checked.
+void CPageCostEstimator::addBrush(const IDOMBrushPtr& brush)
+{
+    if (!brush)
+    {
+        return;
+    }
+
+    if (brush->getBrushType() == IDOMBrush::eMasked)
+    {
+        addBrush(edlobj2IDOMMaskedBrush(brush)->getBrush());
+        return;
+    }
+    if (brush->getBrushType() != IDOMBrush::eImage)
+    {
+        return;
+    }
+
+    IImageFramePtr frame = edlobj2IDOMImageBrush(brush)->getImageSource()->getImageFrame(m_jawsMako);
+    IDOMColorSpacePtr colorSpace = frame->getColorSpace();
+    if (!edlobj2IDOMColorSpaceDeviceCMYK(colorSpace))
+    {
+        return;
+    }
+
+    // The detection pass reads every row, and the conversion pass reads them again
+    m_imageBytes += (uint64) frame->getRawBytesPerRow() * frame->getHeight() * 2;
+}
@@ -0,0 +1,40 @@
+/* -----------------------------------------------------------------------
+ *  <copyright file="PageCost.h" company="Global Graphics Software Ltd">
+ *      Copyright (c) 2023 Global Graphics Software Ltd. All rights reserved.
+ *  </copyright>
+ *  <summary>
+ *  This example is provided on an "as is" basis and without warranty of any kind.
+ *  Global Graphics Software Ltd. does not warrant or make any representations regarding the use or
+ *  results of use of this example.
+ *  </summary>
+ * -----------------------------------------------------------------------
+ */
+
+#pragma once
+
+#include <jawsmako/jawsmako.h>
+#include <jawsmako/customtransform.h>
+
+using namespace JawsMako;
+
+// A rough estimate of the work needed to convert a page, used to schedule the most expensive pages first.
+// It counts the nodes the converter will visit and the bytes of CMYK image data it may have to decode,
+// which dominate. Nothing is decoded to make the estimate, and the page is not changed.
+class CPageCostEstimator : public ICustomTransform::IImplementation
+{
+public:
+    CPageCostEstimator(const IJawsMakoPtr& jawsMako);
+
+    IDOMNodePtr transformGlyphs(IImplementation* genericImplementation, const IDOMGlyphsPtr& glyphs, bool& changed, const CTransformState& state) override;
+    IDOMNodePtr transformPath(IImplementation* genericImplementation, const IDOMPathNodePtr& path, bool& changed, const CTransformState& state) override;
+
+    // Estimate the cost of a page, in units of about one byte of image data
+    uint64 estimate(const IPagePtr& page);
+
+private:
+    void addBrush(const IDOMBrushPtr& brush);
+
+    const IJawsMakoPtr m_jawsMako;
+    uint64 m_nodes;
+    uint64 m_imageBytes;
+};
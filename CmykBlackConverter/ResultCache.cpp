@@ -0,0 +1,155 @@
+/* -----------------------------------------------------------------------
+ *  <copyright file="ResultCache.cpp" company="Global Graphics Software Ltd">
+ *      Copyright (c) 2023 Global Graphics Software Ltd. All rights reserved.
+ *  </copyright>
+ *  <summary>
+ *  This example is provided on an "as is" basis and without warranty of any kind.
+ *  Global Graphics Software Ltd. does not warrant or make any representations regarding the use or
+ *  results of use of this example.
+ *  </summary>
+ * -----------------------------------------------------------------------
+ */
+
+#include "ResultCache.h"
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <random>
+#include <vector>
+
+#include "ContentHash.h"
+
+namespace fs = std::filesystem;
+
+static const char* const entryExtension = ".pdf";
+static const char* const tempExtension = ".tmp";
+
+// Temporary files older than this were left by a run that did not finish, and are removed
+static const std::chrono::hours staleTempAge(1);
+
+CResultCache::CResultCache(const std::string& directory, uint64_t maxBytes) :
+    m_directory(directory), m_maxBytes(maxBytes)
+{
+    fs::create_directories(m_directory);
+}
+
+std::string CResultCache::makeKey(const std::string& inputFile, const std::string& settings)
+{
+    CContentHash hash;
+    hash.update(settings);
+    hash.update("", 1);
+    if (!CContentHash::hashFile(inputFile, hash))
+    {
+        return std::string();
+    }
+    return hash.finalHex();
+}
+
+std::string CResultCache::entryPath(const std::string& key) const
+{
+    return (fs::path(m_directory) / (key + entryExtension)).string();
+}
+
+bool CResultCache::fetch(const std::string& key, const std::string& outputFile) const
+{
+    std::error_code error;
+    const std::string entry = entryPath(key);
+
+    // Another run may remove the entry at any time, so just try the copy
+    if (!fs::copy_file(entry, outputFile, fs::copy_options::overwrite_existing, error))
+    {
+        return false;
+    }
+
+    // Mark it as recently used
+    fs::last_write_time(entry, fs::file_time_type::clock::now(), error);
+    return true;
+}
+
+void CResultCache::store(const std::string& key, const std::string& outputFile) const
+{
+    std::random_device random;
+    const std::string temp = (fs::path(m_directory) / (key + "." + std::to_string(random()) + std::to_string(random()) + tempExtension)).string();
+
+    std::error_code error;
+    if (!fs::copy_file(outputFile, temp, error))
+    {
+        fs::remove(temp, error);
+        return;
+    }
+
+    // The rename replaces any entry another run stored meanwhile, which has the same content
+    fs::rename(temp, entryPath(key), error);
+    if (error)
+    {
+        fs::remove(temp, error);
+        return;
+    }
+
+    evict();
+}
+
+void CResultCache::evict() const
+{
+    if (!m_maxBytes)
+    {
+        return;
+    }
+
+    struct CEntry
+    {
+        fs::path path;
+        fs::file_time_type lastUsed;
+        uint64_t size;
+    };
+
+    std::error_code error;
+    std::vector<CEntry> entries;
+    uint64_t totalBytes = 0;
+    const fs::file_time_type now = fs::file_time_type::clock::now();
+
+    for (const fs::directory_entry& item : fs::directory_iterator(m_directory, error))
+    {
+        std::error_code itemError;
+        const fs::path& path = item.path();
+        const fs::file_time_type lastUsed = item.last_write_time(itemError);
+        const uint64_t size = item.file_size(itemError);
+        if (itemError)
+        {
+            // Removed by another run
+            continue;
+        }
+
+        if (path.extension() == tempExtension)
+        {
+            if (now - lastUsed > staleTempAge)
+            {
+                fs::remove(path, itemError);
+            }
+            continue;
+        }
+        if (path.extension() == entryExtension)
+        {
+            entries.push_back({ path, lastUsed, size });
+            totalBytes += size;
+        }
+    }
+
+    if (totalBytes <= m_maxBytes)
+    {
+        return;
+    }
+
+    // Oldest first
+    std::sort(entries.begin(), entries.end(), [](const CEntry& a, const CEntry& b) { return a.lastUsed < b.lastUsed; });
+    for (const CEntry& entry : entries)
+    {
+        if (totalBytes <= m_maxBytes)
+        {
+            break;
+        }
+        fs::remove(entry.path, error);
+        totalBytes -= entry.size;
+    }
+}
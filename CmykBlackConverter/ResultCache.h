@@ -0,0 +1,43 @@
+/* -----------------------------------------------------------------------
+ *  <copyright file="ResultCache.h" company="Global Graphics Software Ltd">
+ *      Copyright (c) 2023 Global Graphics Software Ltd. All rights reserved.
+ *  </copyright>
+ *  <summary>
+ *  This example is provided on an "as is" basis and without warranty of any kind.
+ *  Global Graphics Software Ltd. does not warrant or make any representations regarding the use or
+ *  results of use of this example.
+ *  </summary>
+ * -----------------------------------------------------------------------
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+// An on-disk cache of converted documents, shared between runs. Entries are named by a hash of the input
+// file and everything else that determines the output, so a resubmitted document is found again whatever
+// it is called. Entries are written to a temporary name and renamed into place, so any number of runs can
+// share a cache directory. When the cache grows past its size limit the least recently used entries are
+// removed.
+class CResultCache
+{
+public:
+    CResultCache(const std::string& directory, uint64_t maxBytes);
+
+    // The key for an input file converted with the given settings. Empty if the file could not be read.
+    static std::string makeKey(const std::string& inputFile, const std::string& settings);
+
+    // Copy a cached result to outputFile. Returns false on a miss.
+    bool fetch(const std::string& key, const std::string& outputFile) const;
+
+    // Add a result to the cache, then trim the cache to its size limit
+    void store(const std::string& key, const std::string& outputFile) const;
+
+private:
+    std::string entryPath(const std::string& key) const;
+    void evict() const;
+
+    std::string m_directory;
+    uint64_t m_maxBytes;            // 0 for no limit
+};
@@ -0,0 +1,235 @@
+/* -----------------------------------------------------------------------
+ *  <copyright file="TaskScheduler.cpp" company="Global Graphics Software Ltd">
+ *      Copyright (c) 2023 Global Graphics Software Ltd. All rights reserved.
+ *  </copyright>
+ *  <summary>
+ *  This example is provided on an "as is" basis and without warranty of any kind.
+ *  Global Graphics Software Ltd. does not warrant or make any representations regarding the use or
+ *  results of use of this example.
+ *  </summary>
+ * -----------------------------------------------------------------------
+ */
+
+#include "TaskScheduler.h"
+
+#include <algorithm>
+
+CTaskGroup::CTaskGroup() :
+    m_state(std::make_shared<CState>())
+{
+}
+
+CWorkStealingPool::CWorkStealingPool(uint32_t numThreads) :
+    m_nextQueue(0), m_queued(0), m_unfinished(0), m_stopping(false)
+{
+    if (!numThreads)
+    {
+        numThreads = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    for (uint32_t worker = 0; worker < numThreads; worker++)
+    {
+        m_queues.emplace_back(new CWorkerQueue);
+    }
+    for (uint32_t worker = 0; worker < numThreads; worker++)
+    {
+        m_workers.emplace_back(&CWorkStealingPool::run, this, worker);
+    }
+}
+
+CWorkStealingPool::~CWorkStealingPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_taskQueued.notify_all();
+    for (std::thread& worker : m_workers)
+    {
+        worker.join();
+    }
+}
+
+void CWorkStealingPool::submit(CTask task)
+{
+    reserve();
+    submitReserved(std::move(task));
+}
+
+void CWorkStealingPool::reserve()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_unfinished++;
+}
+
+void CWorkStealingPool::submitReserved(CTask task)
+{
+    CWorkerQueue& queue = *m_queues[m_nextQueue++ % m_queues.size()];
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.tasks.push_back(std::move(task));
+    }
+    m_queued++;
+
+    // Taking the lock means a worker about to sleep either sees the task or gets the notification
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+    }
+    m_taskQueued.notify_one();
+}
+
+void CWorkStealingPool::wait()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_allFinished.wait(lock, [this] { return m_unfinished == 0; });
+    if (m_error)
+    {
+        std::exception_ptr error = m_error;
+        m_error = nullptr;
+        std::rethrow_exception(error);
+    }
+}
+
+void CWorkStealingPool::submit(CTaskGroup& group, CTask task)
+{
+    std::shared_ptr<CTaskGroup::CState> state = group.m_state;
+    {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        state->tasks.push_back(std::move(task));
+        state->unfinished++;
+    }
+
+    // The pool's task runs one of the group's tasks, if the waiting thread hasn't got to them all first
+    submit([state] { runGroupTask(*state); });
+}
+
+void CWorkStealingPool::wait(CTaskGroup& group)
+{
+    CTaskGroup::CState& state = *group.m_state;
+    while (runGroupTask(state))
+    {
+    }
+
+    std::unique_lock<std::mutex> lock(state.mutex);
+    state.finished.wait(lock, [&state] { return state.unfinished == 0; });
+    if (state.error)
+    {
+        std::exception_ptr error = state.error;
+        state.error = nullptr;
+        std::rethrow_exception(error);
+    }
+}
+
+// Run one of a group's queued tasks. Returns false if there were none left.
+bool CWorkStealingPool::runGroupTask(CTaskGroup::CState& group)
+{
+    CTask task;
+    {
+        std::lock_guard<std::mutex> lock(group.mutex);
+        if (group.tasks.empty())
+        {
+            return false;
+        }
+        task = std::move(group.tasks.front());
+        group.tasks.pop_front();
+    }
+
+    std::exception_ptr error;
+    try
+    {
+        task();
+    }
+    catch (...)
+    {
+        error = std::current_exception();
+    }
+
+    std::lock_guard<std::mutex> lock(group.mutex);
+    if (error && !group.error)
+    {
+        group.error = error;
+    }
+    if (--group.unfinished == 0)
+    {
+        group.finished.notify_all();
+    }
+    return true;
+}
+
+// Take the next task from this worker's queue, or failing that from another's
+bool CWorkStealingPool::takeTask(uint32_t worker, CTask& task)
+{
+    const size_t numQueues = m_queues.size();
+    for (size_t i = 0; i < numQueues; i++)
+    {
+        CWorkerQueue& queue = *m_queues[(worker + i) % numQueues];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (!queue.tasks.empty())
+        {
+            task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+            m_queued--;
+            return true;
+        }
+    }
+    return false;
+}
+
+void CWorkStealingPool::run(uint32_t worker)
+{
+    for (;;)
+    {
+        CTask task;
+        if (takeTask(worker, task))
+        {
+            std::exception_ptr error;
+            try
+            {
+                task();
+            }
+            catch (...)
+            {
+                error = std::current_exception();
+            }
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (error && !m_error)
+            {
+                m_error = error;
+            }
+            if (--m_unfinished == 0)
+            {
+                m_allFinished.notify_all();
+            }
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_taskQueued.wait(lock, [this] { return m_queued > 0 || m_stopping; });
+        if (m_stopping && m_queued == 0)
+        {
+            return;
+        }
+    }
+}
+
+CMemoryBudget::CMemoryBudget(uint64_t maxBytes) :
+    m_maxBytes(maxBytes), m_usedBytes(0)
+{
+}
+
+void CMemoryBudget::acquire(uint64_t bytes)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_released.wait(lock, [this, bytes] { return !m_maxBytes || !m_usedBytes || m_usedBytes + bytes <= m_maxBytes; });
+    m_usedBytes += bytes;
+}
+
+void CMemoryBudget::release(uint64_t bytes)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_usedBytes -= std::min(bytes, m_usedBytes);
+    }
+    m_released.notify_all();
+}
@@ -0,0 +1,121 @@
+/* -----------------------------------------------------------------------
+ *  <copyright file="TaskScheduler.h" company="Global Graphics Software Ltd">
+ *      Copyright (c) 2023 Global Graphics Software Ltd. All rights reserved.
+ *  </copyright>
+ *  <summary>
+ *  This example is provided on an "as is" basis and without warranty of any kind.
+ *  Global Graphics Software Ltd. does not warrant or make any representations regarding the use or
+ *  results of use of this example.
+ *  </summary>
+ * -----------------------------------------------------------------------
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class CWorkStealingPool;
+
+// A set of related tasks that one thread waits for, such as the bands of an image. While it waits, the thread
+// runs the group's tasks itself, so waiting inside a pool task can never leave the group without a thread.
+class CTaskGroup
+{
+public:
+    CTaskGroup();
+
+private:
+    friend class CWorkStealingPool;
+
+    struct CState
+    {
+        std::mutex mutex;
+        std::condition_variable finished;
+        std::deque<std::function<void()>> tasks;
+        uint32_t unfinished = 0;
+        std::exception_ptr error;
+    };
+    std::shared_ptr<CState> m_state;   // Shared with queued tasks, which may outlive the group
+};
+
+// Runs tasks on a fixed set of worker threads. Each worker has its own queue and takes tasks from the front
+// of it; a worker whose queue is empty steals from the front of another's, so work spreads out without one
+// shared queue becoming a bottleneck. Tasks are handed out in the order given, so submitting the longest
+// tasks first keeps every worker busy until the end.
+class CWorkStealingPool
+{
+public:
+    typedef std::function<void()> CTask;
+
+    // Zero threads means one per hardware thread
+    explicit CWorkStealingPool(uint32_t numThreads);
+    ~CWorkStealingPool();
+
+    CWorkStealingPool(const CWorkStealingPool&) = delete;
+    CWorkStealingPool& operator=(const CWorkStealingPool&) = delete;
+
+    uint32_t numThreads() const { return (uint32_t) m_workers.size(); }
+
+    // Tasks may submit further tasks
+    void submit(CTask task);
+
+    // A task that can't run yet is reserved, and submitted later from any thread. wait() waits for it meanwhile.
+    void reserve();
+    void submitReserved(CTask task);
+
+    // Wait for every task submitted so far to finish. The first exception thrown by a task is rethrown here.
+    void wait();
+
+    // Group tasks are run by the pool, or by the thread waiting for the group
+    void submit(CTaskGroup& group, CTask task);
+    void wait(CTaskGroup& group);
+
+private:
+    struct CWorkerQueue
+    {
+        std::mutex mutex;
+        std::deque<CTask> tasks;
+    };
+
+    void run(uint32_t worker);
+    bool takeTask(uint32_t worker, CTask& task);
+    static bool runGroupTask(CTaskGroup::CState& group);
+
+    std::vector<std::unique_ptr<CWorkerQueue>> m_queues;
+    std::vector<std::thread> m_workers;
+    std::atomic<uint32_t> m_nextQueue;  // Round robin for submitted tasks
+    std::atomic<uint64_t> m_queued;     // Tasks waiting in any queue
+    uint64_t m_unfinished;              // Tasks submitted and not yet finished
+    bool m_stopping;
+    std::exception_ptr m_error;
+    std::mutex m_mutex;
+    std::condition_variable m_taskQueued;
+    std::condition_variable m_allFinished;
+};
+
+// Limits the memory used by work in flight. A producer acquires its share before starting a piece of work,
+// and waiting there holds back new work until enough earlier work has released its share. A share larger than
+// the whole budget is allowed once nothing else is in flight.
+class CMemoryBudget
+{
+public:
+    // Zero bytes means no limit
+    explicit CMemoryBudget(uint64_t maxBytes);
+
+    void acquire(uint64_t bytes);
+    void release(uint64_t bytes);
+
+private:
+    const uint64_t m_maxBytes;
+    uint64_t m_usedBytes;
+    std::mutex m_mutex;
+    std::condition_variable m_released;
+};
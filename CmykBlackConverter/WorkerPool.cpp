@@ -0,0 +1,545 @@
+/* -----------------------------------------------------------------------
+ *  <copyright file="WorkerPool.cpp" company="Global Graphics Software Ltd">
+ *      Copyright (c) 2023 Global Graphics Software Ltd. All rights reserved.
+ *  </copyright>
+ *  <summary>
+ *  This example is provided on an "as is" basis and without warranty of any kind.
+ *  Global Graphics Software Ltd. does not warrant or make any representations regarding the use or
+ *  results of use of this example.
+ *  </summary>
+ * -----------------------------------------------------------------------
+ */
+
+#include "WorkerPool.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <cerrno>
+#include <csignal>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+namespace fs = std::filesystem;
+
+const char* const CWorkerProcessPool::workerOption = "worker-process";
+
+// Jobs are sent as the input file then the output file, each as "<length>:<bytes>" so that a path may hold any
+// character, and answered with "<exit code>\n"
+static const size_t maxFieldBytes = 64 * 1024;
+
+// The output file given for an analysis written to stdout
+static const char* const standardOutput = "*";
+
+#ifdef _WIN32
+typedef HANDLE CPipe;
+static const CPipe noPipe = nullptr;
+#else
+typedef int CPipe;
+static const CPipe noPipe = -1;
+#endif
+
+struct CWorkerProcessPool::CWorker
+{
+#ifdef _WIN32
+    HANDLE process = nullptr;
+#else
+    pid_t process = 0;
+#endif
+    CPipe toWorker = noPipe;
+    CPipe fromWorker = noPipe;
+    uint32_t jobsDone = 0;
+};
+
+static bool writeAll(CPipe pipe, const std::string& data)
+{
+    size_t written = 0;
+    while (written < data.size())
+    {
+#ifdef _WIN32
+        DWORD length = 0;
+        if (!WriteFile(pipe, data.data() + written, (DWORD) (data.size() - written), &length, nullptr))
+        {
+            return false;
+        }
+#else
+        const ssize_t length = write(pipe, data.data() + written, data.size() - written);
+        if (length < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (length <= 0)
+        {
+            return false;
+        }
+#endif
+        written += (size_t) length;
+    }
+    return true;
+}
+
+// Read one character, waiting no more than timeoutMs (-1 for no limit). Returns 1 if one was read, 0 on
+// timeout and -1 if the other end has gone.
+static int readChar(CPipe pipe, char& c, int64_t timeoutMs)
+{
+#ifdef _WIN32
+    // Anonymous pipes can't be waited on, so poll
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+    for (;;)
+    {
+        DWORD available = 0;
+        if (!PeekNamedPipe(pipe, nullptr, 0, nullptr, &available, nullptr))
+        {
+            return -1;
+        }
+        if (available)
+        {
+            break;
+        }
+        if (timeoutMs >= 0 && std::chrono::steady_clock::now() >= deadline)
+        {
+            return 0;
+        }
+        Sleep(10);
+    }
+
+    DWORD length = 0;
+    return ReadFile(pipe, &c, 1, &length, nullptr) && length == 1 ? 1 : -1;
+#else
+    for (;;)
+    {
+        pollfd item = { pipe, POLLIN, 0 };
+        const int ready = poll(&item, 1, (int) timeoutMs);
+        if (ready < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (ready == 0)
+        {
+            return 0;
+        }
+        const ssize_t length = ready > 0 ? read(pipe, &c, 1) : -1;
+        if (length < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        return length == 1 ? 1 : -1;
+    }
+#endif
+}
+
+static std::string encodeField(const std::string& text)
+{
+    return std::to_string(text.size()) + ":" + text;
+}
+
+// Read a field written by encodeField(). Returns 1 if one was read, and -1 if the other end has gone or
+// sent something else.
+static int readField(CPipe pipe, std::string& field)
+{
+    size_t length = 0;
+    char c;
+    int status;
+    while ((status = readChar(pipe, c, -1)) > 0 && c != ':')
+    {
+        if (c < '0' || c > '9' || length > maxFieldBytes)
+        {
+            return -1;
+        }
+        length = length * 10 + (size_t) (c - '0');
+    }
+    if (status <= 0 || length > maxFieldBytes)
+    {
+        return -1;
+    }
+
+    field.clear();
+    while (field.size() < length)
+    {
+        if (readChar(pipe, c, -1) <= 0)
+        {
+            return -1;
+        }
+        field += c;
+    }
+    return 1;
+}
+
+static void closePipe(CPipe& pipe)
+{
+    if (pipe != noPipe)
+    {
+#ifdef _WIN32
+        CloseHandle(pipe);
+#else
+        close(pipe);
+#endif
+        pipe = noPipe;
+    }
+}
+
+CWorkerProcessPool::CWorkerProcessPool(int argc, char* argv[], uint32_t numWorkers, uint32_t jobsPerWorker, uint32_t timeoutSeconds) :
+    m_jobsPerWorker(jobsPerWorker), m_timeoutSeconds(timeoutSeconds), m_unfinished(0), m_closed(false), m_exitCode(0),
+    m_crashes(0), m_timeouts(0), m_restarts(0)
+{
+#ifdef _WIN32
+    (void) argc;
+    (void) argv;
+    m_commandLine = GetCommandLineW();
+#else
+    // A worker that dies mid-job must not take this process with it
+    signal(SIGPIPE, SIG_IGN);
+
+    std::error_code error;
+    const fs::path self = fs::read_symlink("/proc/self/exe", error);
+    m_command.push_back(error ? std::string(argv[0]) : self.string());
+    for (int arg = 1; arg < argc; arg++)
+    {
+        m_command.push_back(argv[arg]);
+    }
+#endif
+
+    for (uint32_t worker = 0; worker < numWorkers; worker++)
+    {
+        m_supervisors.emplace_back(&CWorkerProcessPool::supervise, this);
+    }
+}
+
+CWorkerProcessPool::~CWorkerProcessPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_closed = true;
+    }
+    m_jobQueued.notify_all();
+    for (std::thread& supervisor : m_supervisors)
+    {
+        supervisor.join();
+    }
+}
+
+void CWorkerProcessPool::add(const std::string& inputFile, const std::string& outputFile)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_jobs.emplace_back(inputFile, outputFile);
+        m_unfinished++;
+    }
+    m_jobQueued.notify_one();
+}
+
+int CWorkerProcessPool::finish()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_jobsFinished.wait(lock, [this] { return m_unfinished == 0; });
+    return m_exitCode;
+}
+
+bool CWorkerProcessPool::takeJob(std::pair<std::string, std::string>& job)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_jobQueued.wait(lock, [this] { return !m_jobs.empty() || m_closed; });
+    if (m_jobs.empty())
+    {
+        return false;
+    }
+    job = std::move(m_jobs.front());
+    m_jobs.pop_front();
+    return true;
+}
+
+void CWorkerProcessPool::finishJob(int exitCode)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (exitCode && !m_exitCode)
+    {
+        m_exitCode = exitCode;
+    }
+    if (--m_unfinished == 0)
+    {
+        m_jobsFinished.notify_all();
+    }
+}
+
+void CWorkerProcessPool::supervise()
+{
+    // Start the worker before there is any work for it, so jobs don't wait for it to start up
+    CWorker worker;
+    startWorker(worker);
+
+    std::pair<std::string, std::string> job;
+    while (takeJob(job))
+    {
+        int exitCode = 1;
+        const eJobResult result = worker.toWorker == noPipe ? eJRCrashed
+                                  : runJob(worker, encodeField(job.first) + encodeField(job.second), exitCode);
+        switch (result)
+        {
+        case eJRDone:
+            if (m_jobsPerWorker && ++worker.jobsDone >= m_jobsPerWorker)
+            {
+                stopWorker(worker, false);
+            }
+            break;
+
+        case eJRCrashed:
+            m_crashes++;
+            stopWorker(worker, true);
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                std::cerr << "Worker process crashed converting " << job.first << std::endl;
+            }
+            break;
+
+        case eJRTimedOut:
+            m_timeouts++;
+            stopWorker(worker, true);
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                std::cerr << "Timed out converting " << job.first << std::endl;
+            }
+            break;
+        }
+
+        // A worker that was stopped mid-job may have left part of its output behind
+        if (result != eJRDone && job.second != standardOutput)
+        {
+            std::error_code error;
+            fs::remove(job.second, error);
+        }
+        finishJob(exitCode);
+
+        // Replace a worker that has stopped straight away, ready for the next job
+        if (worker.toWorker == noPipe)
+        {
+            m_restarts++;
+            startWorker(worker);
+        }
+    }
+
+    stopWorker(worker, false);
+}
+
+CWorkerProcessPool::eJobResult CWorkerProcessPool::runJob(CWorker& worker, const std::string& request, int& exitCode)
+{
+    if (!writeAll(worker.toWorker, request))
+    {
+        return eJRCrashed;
+    }
+
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(m_timeoutSeconds);
+    std::string reply;
+    for (;;)
+    {
+        int64_t timeoutMs = -1;
+        if (m_timeoutSeconds)
+        {
+            timeoutMs = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+            if (timeoutMs <= 0)
+            {
+                return eJRTimedOut;
+            }
+        }
+
+        char c;
+        const int status = readChar(worker.fromWorker, c, timeoutMs);
+        if (status == 0)
+        {
+            return eJRTimedOut;
+        }
+        if (status < 0)
+        {
+            return eJRCrashed;
+        }
+        if (c == '\n')
+        {
+            break;
+        }
+        reply += c;
+    }
+
+    exitCode = atoi(reply.c_str());
+    return eJRDone;
+}
+
+// Start a worker process, connected to this one by a pipe each way. On failure the worker is left stopped, and
+// its jobs fail.
+void CWorkerProcessPool::startWorker(CWorker& worker)
+{
+    worker.jobsDone = 0;
+
+    // No other worker may be started while this one's ends of the pipes are open here, or it would inherit them
+    std::lock_guard<std::mutex> lock(m_startMutex);
+
+#ifdef _WIN32
+    SECURITY_ATTRIBUTES inherit = { sizeof(SECURITY_ATTRIBUTES), nullptr, TRUE };
+    HANDLE workerIn = nullptr;
+    HANDLE workerOut = nullptr;
+    if (!CreatePipe(&workerIn, &worker.toWorker, &inherit, 0))
+    {
+        return;
+    }
+    if (!CreatePipe(&worker.fromWorker, &workerOut, &inherit, 0))
+    {
+        CloseHandle(workerIn);
+        closePipe(worker.toWorker);
+        return;
+    }
+    SetHandleInformation(worker.toWorker, HANDLE_FLAG_INHERIT, 0);
+    SetHandleInformation(worker.fromWorker, HANDLE_FLAG_INHERIT, 0);
+
+    std::wstring commandLine = m_commandLine + L" --" + std::wstring(workerOption, workerOption + strlen(workerOption)) + L" "
+                               + std::to_wstring((uintptr_t) workerIn) + L"," + std::to_wstring((uintptr_t) workerOut);
+    STARTUPINFOW startup = {};
+    startup.cb = sizeof(startup);
+    PROCESS_INFORMATION info = {};
+    const BOOL started = CreateProcessW(nullptr, &commandLine[0], nullptr, nullptr, TRUE, 0, nullptr, nullptr, &startup, &info);
+    CloseHandle(workerIn);
+    CloseHandle(workerOut);
+    if (!started)
+    {
+        closePipe(worker.toWorker);
+        closePipe(worker.fromWorker);
+        return;
+    }
+    CloseHandle(info.hThread);
+    worker.process = info.hProcess;
+#else
+    int toWorker[2];
+    int fromWorker[2];
+    if (pipe(toWorker) != 0)
+    {
+        return;
+    }
+    if (pipe(fromWorker) != 0)
+    {
+        close(toWorker[0]);
+        close(toWorker[1]);
+        return;
+    }
+    for (int fd : { toWorker[0], toWorker[1], fromWorker[0], fromWorker[1] })
+    {
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+
+    // Everything the child needs is prepared first, as only async-signal-safe calls are allowed between fork
+    // and exec in a process with other threads
+    std::vector<std::string> command = m_command;
+    command.push_back(std::string("--") + workerOption);
+    command.push_back(std::to_string(toWorker[0]) + "," + std::to_string(fromWorker[1]));
+    std::vector<char*> args;
+    for (std::string& arg : command)
+    {
+        args.push_back(&arg[0]);
+    }
+    args.push_back(nullptr);
+
+    const pid_t process = fork();
+    if (process == 0)
+    {
+        fcntl(toWorker[0], F_SETFD, 0);
+        fcntl(fromWorker[1], F_SETFD, 0);
+        execv(args[0], args.data());
+        _exit(127);
+    }
+    close(toWorker[0]);
+    close(fromWorker[1]);
+    if (process < 0)
+    {
+        close(toWorker[1]);
+        close(fromWorker[0]);
+        return;
+    }
+    worker.process = process;
+    worker.toWorker = toWorker[1];
+    worker.fromWorker = fromWorker[0];
+#endif
+}
+
+// Stop a worker. Closing its input tells an idle worker to exit; one that has crashed or hung is killed.
+void CWorkerProcessPool::stopWorker(CWorker& worker, bool kill)
+{
+    closePipe(worker.toWorker);
+
+#ifdef _WIN32
+    if (worker.process)
+    {
+        if (kill)
+        {
+            TerminateProcess(worker.process, 1);
+        }
+        WaitForSingleObject(worker.process, INFINITE);
+        CloseHandle(worker.process);
+        worker.process = nullptr;
+    }
+#else
+    if (worker.process > 0)
+    {
+        if (kill)
+        {
+            ::kill(worker.process, SIGKILL);
+        }
+        int status;
+        while (waitpid(worker.process, &status, 0) < 0 && errno == EINTR)
+        {
+        }
+        worker.process = 0;
+    }
+#endif
+
+    closePipe(worker.fromWorker);
+}
+
+int CWorkerProcessPool::runWorker(const std::string& connection, const CJobFunction& job)
+{
+    const size_t comma = connection.find(',');
+    if (comma == std::string::npos)
+    {
+        return 1;
+    }
+#ifdef _WIN32
+    const CPipe fromPool = (HANDLE) (uintptr_t) std::stoull(connection.substr(0, comma));
+    const CPipe toPool = (HANDLE) (uintptr_t) std::stoull(connection.substr(comma + 1));
+#else
+    const CPipe fromPool = std::stoi(connection.substr(0, comma));
+    const CPipe toPool = std::stoi(connection.substr(comma + 1));
+#endif
+
+    for (;;)
+    {
+        std::string inputFile;
+        if (readField(fromPool, inputFile) <= 0)
+        {
+            // The pool has finished with this worker
+            return 0;
+        }
+        std::string outputFile;
+        if (readField(fromPool, outputFile) <= 0)
+        {
+            return 1;
+        }
+
+        int exitCode = 1;
+        try
+        {
+            exitCode = job(inputFile, outputFile);
+        }
+        catch (...)
+        {
+        }
+
+        if (!writeAll(toPool, std::to_string(exitCode) + "\n"))
+        {
+            return 0;
+        }
+    }
+}
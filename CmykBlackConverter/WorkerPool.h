@@ -0,0 +1,98 @@
+/* -----------------------------------------------------------------------
+ *  <copyright file="WorkerPool.h" company="Global Graphics Software Ltd">
+ *      Copyright (c) 2023 Global Graphics Software Ltd. All rights reserved.
+ *  </copyright>
+ *  <summary>
+ *  This example is provided on an "as is" basis and without warranty of any kind.
+ *  Global Graphics Software Ltd. does not warrant or make any representations regarding the use or
+ *  results of use of this example.
+ *  </summary>
+ * -----------------------------------------------------------------------
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Runs conversions in separate worker processes, so that a document that crashes or hangs the SDK takes down
+// only the worker converting it. The workers are started up front, each running this program again with
+// --worker-process, and are sent one job at a time over a pipe. A worker that crashes is replaced, one that
+// takes longer than the timeout over a job is killed and replaced, and each is replaced after a number of jobs
+// to limit the memory it can accumulate. A failed job is reported and not retried, and whatever output a
+// worker that crashed or was killed left behind is deleted.
+class CWorkerProcessPool
+{
+public:
+    // Converts inputFile to outputFile in a worker process, returning the exit code
+    typedef std::function<int(const std::string& inputFile, const std::string& outputFile)> CJobFunction;
+
+    // The option that runs a worker process; its argument identifies the pipes to the pool
+    static const char* const workerOption;
+
+    // argc and argv are this program's, to start the workers with. Zero jobs per worker or timeout means no limit.
+    CWorkerProcessPool(int argc, char* argv[], uint32_t numWorkers, uint32_t jobsPerWorker, uint32_t timeoutSeconds);
+    ~CWorkerProcessPool();
+
+    CWorkerProcessPool(const CWorkerProcessPool&) = delete;
+    CWorkerProcessPool& operator=(const CWorkerProcessPool&) = delete;
+
+    void add(const std::string& inputFile, const std::string& outputFile);
+
+    // Wait for every job. Returns 0 if all succeeded, otherwise the exit code of the first failure.
+    int finish();
+
+    uint32_t getCrashes() const { return m_crashes; }
+    uint32_t getTimeouts() const { return m_timeouts; }
+    uint32_t getRestarts() const { return m_restarts; }
+
+    // The body of a worker process: run the jobs the pool sends until it closes the pipes
+    static int runWorker(const std::string& connection, const CJobFunction& job);
+
+private:
+    struct CWorker;
+    enum eJobResult
+    {
+        eJRDone,
+        eJRCrashed,
+        eJRTimedOut
+    };
+
+    void supervise();           // Each worker has a thread of its own that starts it and feeds it jobs
+    bool takeJob(std::pair<std::string, std::string>& job);
+    void finishJob(int exitCode);
+    eJobResult runJob(CWorker& worker, const std::string& request, int& exitCode);
+    void startWorker(CWorker& worker);
+    void stopWorker(CWorker& worker, bool kill);
+
+#ifdef _WIN32
+    std::wstring m_commandLine;
+#else
+    std::vector<std::string> m_command;
+#endif
+    const uint32_t m_jobsPerWorker;
+    const uint32_t m_timeoutSeconds;
+
+    std::mutex m_mutex;
+    std::condition_variable m_jobQueued;
+    std::condition_variable m_jobsFinished;
+    std::deque<std::pair<std::string, std::string>> m_jobs;
+    uint32_t m_unfinished;          // Jobs added and not yet finished
+    bool m_closed;
+    int m_exitCode;
+
+    std::mutex m_startMutex;        // Workers are started one at a time, so none inherits another's pipes
+    std::vector<std::thread> m_supervisors;
+
+    std::atomic<uint32_t> m_crashes;
+    std::atomic<uint32_t> m_timeouts;
+    std::atomic<uint32_t> m_restarts;
+};